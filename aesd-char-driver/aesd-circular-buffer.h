@@ -16,7 +16,14 @@
 #include <stdbool.h>
 #endif
 
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
+
+// in_offs/out_offs (and the lookup index) are uint8_t
+#if AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED > 255
+#error "AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED must fit in a uint8_t index"
+#endif
 
 struct aesd_buffer_entry
 {
@@ -0,0 +1,354 @@
+/*
+ * ianmclinden, 2024
+ *
+ * Microbenchmarks for the aesd circular buffer. Capacity is fixed at compile
+ * time (see Makefile), entry sizes are given at runtime. Reports ns/op and,
+ * where the kernel allows it, hardware cache misses/op via perf_event_open.
+ */
+
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-circular-buffer.h"
+
+#define CAPACITY AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+const size_t DEFAULT_SIZES[] = {16, 256, 4096};
+const size_t DEFAULT_TARGET_OPS = 2000000;
+const size_t LOOKUP_OFFSETS = 4096; // Power of two, masked below
+const size_t ADD_BATCH = 4096;      // Adds timed between untimed re-inits
+
+const struct option longopts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"ops", required_argument, NULL, 'n'},
+    {"size", required_argument, NULL, 's'},
+    {NULL, 0, NULL, 0}};
+const char *optstring = "hn:s:";
+
+void print_help()
+{
+    printf("bench-circular-buffer - aesd circular buffer microbenchmarks\n");
+    printf("\n");
+    printf("Usage: bench-circular-buffer [options]\n");
+    printf("\n");
+    printf("Options:\n");
+    printf(" --help, -h             Print this help and exit\n");
+    printf(" --ops, -n <N>          Operations per benchmark. (Default: %zu)\n", DEFAULT_TARGET_OPS);
+    printf(" --size, -s <BYTES>     Entry size, may be repeated. (Default: 16, 256, 4096)\n");
+}
+
+// Keeps results observable so the compiler can't drop the measured loops
+volatile uintptr_t sink;
+
+struct counter
+{
+    int fd;
+    uint64_t misses;
+};
+
+static void counter_open(struct counter *ctr)
+{
+    struct perf_event_attr attr = {0};
+
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    // Not fatal, VMs and containers frequently don't expose the PMU
+    ctr->fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    ctr->misses = 0;
+}
+
+static void counter_start(struct counter *ctr)
+{
+    if (-1 != ctr->fd)
+    {
+        ioctl(ctr->fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(ctr->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static void counter_stop(struct counter *ctr)
+{
+    if (-1 != ctr->fd)
+    {
+        ioctl(ctr->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (sizeof(ctr->misses) != read(ctr->fd, &ctr->misses, sizeof(ctr->misses)))
+        {
+            ctr->misses = 0;
+        }
+    }
+}
+
+// Stop counting without losing the count, for untimed setup mid benchmark
+static void counter_pause(struct counter *ctr)
+{
+    if (-1 != ctr->fd)
+    {
+        ioctl(ctr->fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+static void counter_resume(struct counter *ctr)
+{
+    if (-1 != ctr->fd)
+    {
+        ioctl(ctr->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void report(const char *op, size_t size, size_t ops, uint64_t ns, const struct counter *ctr)
+{
+    printf("%4d %6zu %-8s %10zu %10.2f ", CAPACITY, size, op, ops, (double)ns / (double)ops);
+    if (-1 == ctr->fd)
+    {
+        printf("%12s\n", "-");
+    }
+    else
+    {
+        printf("%12.3f\n", (double)ctr->misses / (double)ops);
+    }
+}
+
+// Fill every slot with a distinct size-byte region of pool
+static void fill(struct aesd_circular_buffer *buffer, char *pool, size_t size)
+{
+    aesd_circular_buffer_init(buffer);
+    for (size_t i = 0; i < CAPACITY; i++)
+    {
+        struct aesd_buffer_entry e = {.buffptr = pool + (i * size), .size = size};
+        aesd_circular_buffer_add_entry(buffer, &e);
+    }
+}
+
+// Adds into buffers that are re-initialized once they fill, so no evictions
+// are measured. Re-init is a memset of the whole buffer, so a batch of
+// buffers is initialized outside the timing and cache miss count, then
+// filled in one timed run.
+static void bench_add(char *pool, size_t size, size_t ops, struct counter *ctr)
+{
+    size_t nbuf = (ADD_BATCH + CAPACITY - 1) / CAPACITY;
+    struct aesd_circular_buffer *buffers = malloc(nbuf * sizeof(struct aesd_circular_buffer));
+    uint64_t start, elapsed = 0;
+    size_t i = 0;
+
+    if (NULL == buffers)
+    {
+        fprintf(stderr, "Failed to allocate %zu buffers\n", nbuf);
+        return;
+    }
+
+    counter_start(ctr);
+    while (i < ops)
+    {
+        counter_pause(ctr);
+        for (size_t b = 0; b < nbuf; b++)
+        {
+            aesd_circular_buffer_init(&buffers[b]);
+        }
+        counter_resume(ctr);
+
+        start = now_ns();
+        for (size_t b = 0; (b < nbuf) && (i < ops); b++)
+        {
+            for (size_t j = 0; (j < CAPACITY) && (i < ops); j++, i++)
+            {
+                struct aesd_buffer_entry e = {.buffptr = pool + (j * size), .size = size};
+                aesd_circular_buffer_add_entry(&buffers[b], &e);
+            }
+        }
+        elapsed += now_ns() - start;
+        sink += buffers[0].in_offs;
+    }
+    counter_stop(ctr);
+    report("add", size, ops, elapsed, ctr);
+    free(buffers);
+}
+
+// Adds into a permanently full buffer, each add evicts the oldest entry which
+// the caller must reclaim (as the driver would kfree it)
+static void bench_evict(char *pool, size_t size, size_t ops, struct counter *ctr)
+{
+    struct aesd_circular_buffer buffer;
+    uint64_t start, end;
+    uintptr_t reclaimed = 0;
+
+    fill(&buffer, pool, size);
+    counter_start(ctr);
+    start = now_ns();
+    for (size_t i = 0; i < ops; i++)
+    {
+        struct aesd_buffer_entry e = {.buffptr = pool + ((i % CAPACITY) * size), .size = size};
+        reclaimed ^= (uintptr_t)buffer.entry[buffer.in_offs].buffptr;
+        aesd_circular_buffer_add_entry(&buffer, &e);
+    }
+    end = now_ns();
+    counter_stop(ctr);
+    sink += reclaimed;
+    report("evict", size, ops, end - start, ctr);
+}
+
+// Random char offsets across a full buffer
+static void bench_lookup(char *pool, size_t size, size_t ops, struct counter *ctr)
+{
+    struct aesd_circular_buffer buffer;
+    size_t *offsets = malloc(LOOKUP_OFFSETS * sizeof(size_t));
+    size_t entry_offset = 0;
+    uintptr_t found = 0;
+    uint64_t start, end;
+
+    if (NULL == offsets)
+    {
+        perror("failed to allocate lookup offsets");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (size_t i = 0; i < LOOKUP_OFFSETS; i++)
+    {
+        offsets[i] = (size_t)rand() % (CAPACITY * size);
+    }
+
+    fill(&buffer, pool, size);
+    counter_start(ctr);
+    start = now_ns();
+    for (size_t i = 0; i < ops; i++)
+    {
+        found ^= (uintptr_t)aesd_circular_buffer_find_entry_offset_for_fpos(
+            &buffer, offsets[i & (LOOKUP_OFFSETS - 1)], &entry_offset);
+    }
+    end = now_ns();
+    counter_stop(ctr);
+    sink += found + entry_offset;
+    free(offsets);
+    report("lookup", size, ops, end - start, ctr);
+}
+
+// Full-buffer sequential read the way the driver's read() walks it: look up
+// the current position, copy out the rest of that entry, advance. One op is
+// one complete pass over the buffer contents.
+static void bench_seqread(char *pool, size_t size, size_t ops, struct counter *ctr)
+{
+    struct aesd_circular_buffer buffer;
+    char *dst = malloc(CAPACITY * size);
+    uint64_t start, end;
+
+    if (NULL == dst)
+    {
+        perror("failed to allocate read buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every pass reads the whole buffer, scale down to keep runtime similar
+    ops = ops / CAPACITY;
+    ops = (0 == ops) ? 1 : ops;
+
+    fill(&buffer, pool, size);
+    counter_start(ctr);
+    start = now_ns();
+    for (size_t i = 0; i < ops; i++)
+    {
+        size_t pos = 0, entry_offset = 0;
+        struct aesd_buffer_entry *entry;
+        while (NULL != (entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, pos, &entry_offset)))
+        {
+            memcpy(dst + pos, entry->buffptr + entry_offset, entry->size - entry_offset);
+            pos += entry->size - entry_offset;
+        }
+        sink += pos;
+    }
+    end = now_ns();
+    counter_stop(ctr);
+    sink += (uintptr_t)dst[0];
+    free(dst);
+    report("seqread", size, ops, end - start, ctr);
+}
+
+int main(int argc, char **argv)
+{
+    int opt = -1;
+    size_t ops = DEFAULT_TARGET_OPS;
+    size_t sizes[16];
+    size_t nsizes = 0;
+    struct counter ctr;
+
+    while (-1 != (opt = getopt_long(argc, argv, optstring, longopts, 0)))
+    {
+        switch (opt)
+        {
+        case 'h':
+            print_help();
+            exit(EXIT_SUCCESS);
+        case 'n':
+            ops = (size_t)strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            if (nsizes < sizeof(sizes) / sizeof(sizes[0]))
+            {
+                sizes[nsizes++] = (size_t)strtoull(optarg, NULL, 0);
+            }
+            break;
+        case ':':
+            fprintf(stderr, "Option '%c' requires an argument\n", (char)optopt);
+            __attribute__((fallthrough));
+        default:
+            print_help();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (0 == nsizes)
+    {
+        nsizes = sizeof(DEFAULT_SIZES) / sizeof(DEFAULT_SIZES[0]);
+        memcpy(sizes, DEFAULT_SIZES, sizeof(DEFAULT_SIZES));
+    }
+    if (0 == ops)
+    {
+        fprintf(stderr, "Operation count must be non-zero\n");
+        exit(EXIT_FAILURE);
+    }
+
+    counter_open(&ctr);
+    printf("%4s %6s %-8s %10s %10s %12s\n", "cap", "size", "op", "ops", "ns/op", "misses/op");
+
+    for (size_t s = 0; s < nsizes; s++)
+    {
+        size_t size = (0 == sizes[s]) ? 1 : sizes[s];
+        char *pool = malloc(CAPACITY * size);
+        if (NULL == pool)
+        {
+            perror("failed to allocate entry pool");
+            exit(EXIT_FAILURE);
+        }
+        memset(pool, 'a', CAPACITY * size);
+
+        bench_add(pool, size, ops, &ctr);
+        bench_evict(pool, size, ops, &ctr);
+        bench_lookup(pool, size, ops, &ctr);
+        bench_seqread(pool, size, ops, &ctr);
+
+        free(pool);
+    }
+
+    if (-1 != ctr.fd)
+    {
+        close(ctr.fd);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,222 @@
+/*
+ * ianmclinden, 2024
+ *
+ * Randomized differential test for the aesd circular buffer. Drives the real
+ * buffer and a trivial reference model (a flat, oldest-first array) with the
+ * same random adds and lookups, and fails on the first disagreement.
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define CAPACITY AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+const unsigned long DEFAULT_ROUNDS = 64;
+const unsigned long DEFAULT_STEPS = 10000;
+const size_t MAX_ENTRY_SIZE = 48;
+
+const struct option longopts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"seed", required_argument, NULL, 's'},
+    {"rounds", required_argument, NULL, 'r'},
+    {"steps", required_argument, NULL, 'n'},
+    {NULL, 0, NULL, 0}};
+const char *optstring = "hs:r:n:";
+
+void print_help()
+{
+    printf("test-circular-buffer - differential test against a reference model\n");
+    printf("\n");
+    printf("Usage: test-circular-buffer [options]\n");
+    printf("\n");
+    printf("Options:\n");
+    printf(" --help, -h             Print this help and exit\n");
+    printf(" --seed, -s <SEED>      Seed for the first round. (Default: time)\n");
+    printf(" --rounds, -r <N>       Rounds, each from a fresh buffer. (Default: %lu)\n", DEFAULT_ROUNDS);
+    printf(" --steps, -n <N>        Operations per round. (Default: %lu)\n", DEFAULT_STEPS);
+}
+
+// Oldest entry first, never more than CAPACITY entries
+struct model
+{
+    struct aesd_buffer_entry entry[CAPACITY];
+    size_t count;
+};
+
+static void model_add(struct model *m, const struct aesd_buffer_entry *e)
+{
+    if (CAPACITY == m->count)
+    {
+        memmove(&m->entry[0], &m->entry[1], (CAPACITY - 1) * sizeof(m->entry[0]));
+        m->count--;
+    }
+    m->entry[m->count++] = *e;
+}
+
+static const struct aesd_buffer_entry *model_find(const struct model *m, size_t char_offset, size_t *entry_offset)
+{
+    for (size_t i = 0; i < m->count; i++)
+    {
+        if (char_offset < m->entry[i].size)
+        {
+            *entry_offset = char_offset;
+            return &m->entry[i];
+        }
+        char_offset -= m->entry[i].size;
+    }
+    return NULL;
+}
+
+static size_t model_total(const struct model *m)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < m->count; i++)
+    {
+        total += m->entry[i].size;
+    }
+    return total;
+}
+
+#define CHECK(cond, ...)                                                     \
+    if (!(cond))                                                             \
+    {                                                                        \
+        fprintf(stderr, "FAIL cap=%d seed=%u step=%lu: ", CAPACITY, seed, step); \
+        fprintf(stderr, __VA_ARGS__);                                        \
+        fprintf(stderr, "\n");                                               \
+        return false;                                                        \
+    }
+
+static bool run_round(unsigned int seed, unsigned long steps, const char *pool, size_t pool_size)
+{
+    struct aesd_circular_buffer buffer;
+    struct model m = {.count = 0};
+    unsigned long step = 0;
+
+    srand(seed);
+    aesd_circular_buffer_init(&buffer);
+
+    for (step = 0; step < steps; step++)
+    {
+        if (0 == rand() % 2)
+        {
+            // Add, occasionally zero-length. Distinct pool offsets give every
+            // entry a unique buffptr to compare identities with.
+            struct aesd_buffer_entry e = {
+                .buffptr = pool + ((size_t)rand() % (pool_size - MAX_ENTRY_SIZE)),
+                .size = (0 == rand() % 8) ? 0 : 1 + ((size_t)rand() % MAX_ENTRY_SIZE),
+            };
+
+            // The slot about to be overwritten is the caller's to reclaim, it
+            // must be exactly the model's oldest entry
+            if (buffer.full)
+            {
+                CHECK(CAPACITY == m.count, "buffer full with only %zu model entries", m.count);
+                CHECK(buffer.entry[buffer.in_offs].buffptr == m.entry[0].buffptr &&
+                          buffer.entry[buffer.in_offs].size == m.entry[0].size,
+                      "evicting the wrong entry");
+            }
+
+            aesd_circular_buffer_add_entry(&buffer, &e);
+            model_add(&m, &e);
+
+            CHECK(buffer.full == (CAPACITY == m.count), "full=%d with %zu entries", buffer.full, m.count);
+            CHECK(buffer.in_offs < CAPACITY && buffer.out_offs < CAPACITY, "offsets out of range");
+            CHECK(buffer.entry[(buffer.in_offs + CAPACITY - 1) % CAPACITY].buffptr == e.buffptr,
+                  "newest entry not behind in_offs");
+        }
+        else
+        {
+            // Lookup, biased to land in or just past the stored data
+            size_t total = model_total(&m);
+            size_t pos = (size_t)rand() % (total + MAX_ENTRY_SIZE + 1);
+            size_t real_offs = SIZE_MAX, model_offs = SIZE_MAX;
+            const struct aesd_buffer_entry *real = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, pos, &real_offs);
+            const struct aesd_buffer_entry *ref = model_find(&m, pos, &model_offs);
+
+            CHECK((NULL == real) == (NULL == ref), "pos %zu of %zu: real %s, model %s", pos, total,
+                  real ? "found" : "NULL", ref ? "found" : "NULL");
+            if (NULL != real)
+            {
+                CHECK(real->buffptr == ref->buffptr && real->size == ref->size,
+                      "pos %zu: entry mismatch", pos);
+                CHECK(real_offs == model_offs, "pos %zu: offset %zu, expected %zu", pos, real_offs, model_offs);
+            }
+        }
+    }
+
+    // Every stored entry must be reachable through FOREACH
+    {
+        uint8_t index;
+        struct aesd_buffer_entry *entry;
+        size_t total = 0;
+        AESD_CIRCULAR_BUFFER_FOREACH(entry, &buffer, index)
+        {
+            total += entry->size;
+        }
+        CHECK(total == model_total(&m), "FOREACH saw %zu bytes, model holds %zu", total, model_total(&m));
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int opt = -1;
+    unsigned int seed = (unsigned int)time(NULL);
+    unsigned long rounds = DEFAULT_ROUNDS;
+    unsigned long steps = DEFAULT_STEPS;
+    const size_t pool_size = 1 << 16;
+    char *pool;
+
+    while (-1 != (opt = getopt_long(argc, argv, optstring, longopts, 0)))
+    {
+        switch (opt)
+        {
+        case 'h':
+            print_help();
+            exit(EXIT_SUCCESS);
+        case 's':
+            seed = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            rounds = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            steps = strtoul(optarg, NULL, 0);
+            break;
+        case ':':
+            fprintf(stderr, "Option '%c' requires an argument\n", (char)optopt);
+            __attribute__((fallthrough));
+        default:
+            print_help();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pool = malloc(pool_size);
+    if (NULL == pool)
+    {
+        perror("failed to allocate entry pool");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned long r = 0; r < rounds; r++)
+    {
+        // Print the failing round's seed so it can be replayed with -s SEED -r 1
+        if (!run_round(seed + (unsigned int)r, steps, pool, pool_size))
+        {
+            free(pool);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("cap %d: %lu rounds of %lu steps passed (seed %u)\n", CAPACITY, rounds, steps, seed);
+    free(pool);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+/*
+ * Batch exec throughput.
+ *
+ * Runs the same short command many times, first serially with
+ * do_exec_redirect into a temp file which is then read back, then with
+ * do_exec_batch capturing into memory at increasing parallelism.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "systemcalls.h"
+
+#define TEMP_OUTPUT "/tmp/batch-bench.out"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t read_back(const char *path)
+{
+    char buf[4096];
+    size_t total = 0;
+    size_t n;
+    FILE *f = fopen(path, "r");
+
+    if (NULL == f)
+    {
+        return 0;
+    }
+    while (0 < (n = fread(buf, 1, sizeof(buf), f)))
+    {
+        total += n;
+    }
+    fclose(f);
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    char *command[] = {"/bin/echo", "helper output", NULL};
+    size_t njobs = (argc > 1) ? strtoull(argv[1], NULL, 0) : 2000;
+    size_t max_parallel = (argc > 2) ? strtoull(argv[2], NULL, 0) : 16;
+    char *const **commands;
+    struct exec_result *results;
+    size_t captured = 0;
+    size_t ok = 0;
+    uint64_t start;
+
+    commands = calloc(njobs, sizeof(*commands));
+    results = calloc(njobs, sizeof(*results));
+    if ((0 == njobs) || (NULL == commands) || (NULL == results))
+    {
+        fprintf(stderr, "Usage: batch-bench [JOBS [MAX_PARALLEL]]\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < njobs; i++)
+    {
+        commands[i] = command;
+    }
+
+    printf("%-16s %10s %10s %12s\n", "mode", "ok", "bytes", "jobs_per_s");
+
+    start = now_ns();
+    for (size_t i = 0; i < njobs; i++)
+    {
+        if (do_exec_redirect(TEMP_OUTPUT, 2, command[0], command[1]))
+        {
+            ok++;
+            captured += read_back(TEMP_OUTPUT);
+        }
+    }
+    printf("%-16s %10zu %10zu %12.0f\n", "serial+file", ok, captured, njobs * 1e9 / (double)(now_ns() - start));
+    remove(TEMP_OUTPUT);
+
+    for (size_t parallel = 1; parallel <= max_parallel; parallel *= 2)
+    {
+        char mode[32];
+
+        start = now_ns();
+        ok = do_exec_batch(commands, njobs, parallel, results);
+        captured = 0;
+        for (size_t i = 0; i < njobs; i++)
+        {
+            captured += results[i].out_len;
+        }
+        snprintf(mode, sizeof(mode), "batch -j%zu", parallel);
+        printf("%-16s %10zu %10zu %12.0f\n", mode, ok, captured, njobs * 1e9 / (double)(now_ns() - start));
+        exec_results_free(results, njobs);
+    }
+
+    free(results);
+    free(commands);
+    return EXIT_SUCCESS;
+}
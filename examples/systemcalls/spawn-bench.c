@@ -0,0 +1,94 @@
+/*
+ * Spawn latency against parent RSS.
+ *
+ * Grows this process's resident set in steps, and at each step times
+ * do_exec("/bin/true") and do_exec_redirect("/bin/echo") with both the fork
+ * and posix_spawn backends.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "systemcalls.h"
+
+#define MAX_STEPS 16
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static double time_backend(enum exec_backend backend, bool redirect, int runs)
+{
+    uint64_t start;
+
+    set_exec_backend(backend);
+    start = now_ns();
+    for (int i = 0; i < runs; i++)
+    {
+        bool ok = redirect ? do_exec_redirect("/dev/null", 2, "/bin/echo", "x")
+                           : do_exec(1, "/bin/true");
+        if (!ok)
+        {
+            fprintf(stderr, "command failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (double)(now_ns() - start) / 1e3 / runs;
+}
+
+int main(int argc, char **argv)
+{
+    size_t steps_mib[MAX_STEPS] = {0, 64, 256, 1024};
+    size_t nsteps = 4;
+    int runs = (argc > 1) ? atoi(argv[1]) : 200;
+    char *rss = NULL;
+    size_t rss_mib = 0;
+
+    // Remaining arguments override the RSS steps, in MiB
+    if (argc > 2)
+    {
+        nsteps = 0;
+        for (int i = 2; (i < argc) && (nsteps < MAX_STEPS); i++)
+        {
+            steps_mib[nsteps++] = (size_t)strtoull(argv[i], NULL, 0);
+        }
+    }
+    if (runs <= 0)
+    {
+        fprintf(stderr, "Usage: spawn-bench [RUNS [RSS_MIB...]]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %14s %14s %14s %14s\n", "rss_mib", "fork_us", "spawn_us", "fork_redir_us", "spawn_redir_us");
+    for (size_t s = 0; s < nsteps; s++)
+    {
+        if (steps_mib[s] > rss_mib)
+        {
+            // Touch every page so it is really resident and mapped
+            char *grown = realloc(rss, steps_mib[s] << 20);
+            if (NULL == grown)
+            {
+                perror("failed to grow RSS");
+                break;
+            }
+            rss = grown;
+            memset(rss + (rss_mib << 20), 0xa5, (steps_mib[s] - rss_mib) << 20);
+            rss_mib = steps_mib[s];
+        }
+
+        printf("%8zu %14.1f %14.1f %14.1f %14.1f\n", rss_mib,
+               time_backend(EXEC_BACKEND_FORK, false, runs),
+               time_backend(EXEC_BACKEND_SPAWN, false, runs),
+               time_backend(EXEC_BACKEND_FORK, true, runs),
+               time_backend(EXEC_BACKEND_SPAWN, true, runs));
+        fflush(stdout);
+    }
+
+    free(rss);
+    return EXIT_SUCCESS;
+}
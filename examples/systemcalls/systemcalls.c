@@ -1,11 +1,112 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <spawn.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
+extern char **environ;
+
+static enum exec_backend backend = EXEC_BACKEND_SPAWN;
+
+void set_exec_backend(enum exec_backend new_backend)
+{
+    backend = new_backend;
+}
+
+/**
+ * Start @param command with fork() + execv(), redirecting stdout to
+ * @param outputfile if it is not NULL.
+ * @return the child pid, or -1 if fork failed. exec failures surface as a
+ *   non-zero exit status.
+ */
+static pid_t start_fork(char *const command[], const char *outputfile)
+{
+    pid_t cpid = fork();
+    int fd;
+
+    if (0 == cpid)
+    {
+        if (NULL != outputfile)
+        {
+            fd = open(outputfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+            if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+            {
+                exit(EXIT_FAILURE);
+            }
+            close(fd);
+        }
+        execv(command[0], command);
+        exit(errno);
+    }
+    return cpid;
+}
+
+/**
+ * Start @param command with posix_spawn(), which glibc implements with
+ * clone(CLONE_VM | CLONE_VFORK): the parent's page tables are never copied,
+ * so the cost doesn't grow with the parent's RSS. The redirect is a spawn file
+ * action performed in the child before exec.
+ * @return the child pid, or -1 if the command could not be started
+ *   (including exec and redirect failures, which posix_spawn reports).
+ */
+static pid_t start_spawn(char *const command[], const char *outputfile)
+{
+    posix_spawn_file_actions_t actions;
+    pid_t cpid = -1;
+    int rc;
+
+    if (0 != posix_spawn_file_actions_init(&actions))
+    {
+        return -1;
+    }
+    if ((NULL != outputfile) &&
+        (0 != posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                                               O_WRONLY | O_TRUNC | O_CREAT, 0644)))
+    {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+    rc = posix_spawn(&cpid, command[0], &actions, NULL, command, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    return (0 == rc) ? cpid : -1;
+}
+
+/**
+ * @return true if the waitpid() @param status is a normal exit with status 0.
+ */
+static bool exit_success(int status)
+{
+    return (!WIFSIGNALED(status) &&
+            !WIFSTOPPED(status) &&
+            (WIFEXITED(status) && 0 == WEXITSTATUS(status)));
+}
+
+/**
+ * Run @param command to completion with the selected backend.
+ * @return true if it ran and exited with status 0.
+ */
+static bool run_command(char *const command[], const char *outputfile)
+{
+    pid_t cpid, ppid;
+    int status;
+
+    cpid = (EXEC_BACKEND_FORK == backend) ? start_fork(command, outputfile) : start_spawn(command, outputfile);
+    if (-1 == cpid)
+    {
+        return false;
+    }
+
+    ppid = waitpid(cpid, &status, 0);
+    return (ppid != -1) && exit_success(status);
+}
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -48,24 +149,7 @@ bool do_exec(int count, ...)
     va_end(args);
     command[count] = NULL;
 
-    pid_t cpid, ppid;
-    int status;
-
-    cpid = fork();
-    switch (cpid)
-    {
-    case -1:
-        return false;
-    case 0:
-        execv(command[0], command);
-        exit(errno);
-    default:
-        ppid = waitpid(cpid, &status, 0);
-        return ((ppid != -1) &&
-                !WIFSIGNALED(status) &&
-                !WIFSTOPPED(status) &&
-                (WIFEXITED(status) && 0 == WEXITSTATUS(status)));
-    }
+    return run_command(command, NULL);
 }
 
 /**
@@ -86,29 +170,376 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
     va_end(args);
     command[count] = NULL;
 
-    pid_t cpid, ppid;
-    int fd;
-    int status;
+    return run_command(command, outputfile);
+}
+
+#define BATCH_READ_CHUNK 4096
+#define BATCH_MAX_EVENTS 64
+/**
+ * How often to poll for exited children when pidfd_open is unavailable
+ */
+#define BATCH_REAP_POLL_MS 10
+
+enum batch_source
+{
+    BATCH_OUT,
+    BATCH_ERR,
+    BATCH_PIDFD,
+};
+
+/**
+ * One running command of a do_exec_batch. epoll events carry the slot index
+ * and the batch_source, packed as (index << 2) | source.
+ */
+struct batch_slot
+{
+    /**
+     * Running child, 0 when the slot is free
+     */
+    pid_t pid;
+    size_t job;
+    /**
+     * stdout and stderr read ends, -1 once at EOF
+     */
+    int fds[2];
+    size_t caps[2];
+    /**
+     * -1 if the kernel has no pidfd_open, in which case the child is polled
+     */
+    int pidfd;
+    bool exited;
+};
+
+static int batch_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void batch_watch(int epfd, int *fd, size_t slot, enum batch_source source)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = (slot << 2) | source};
+
+    if (0 != epoll_ctl(epfd, EPOLL_CTL_ADD, *fd, &ev))
+    {
+        close(*fd); // Treated as EOF, or as "no pidfd" for BATCH_PIDFD
+        *fd = -1;
+    }
+}
+
+/**
+ * Stop watching and close *@param fd. A child between clone and exec can
+ * still hold a reference, so closing alone doesn't reliably drop it from the
+ * epoll set.
+ */
+static void batch_unwatch(int epfd, int *fd)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, *fd, NULL);
+    close(*fd);
+    *fd = -1;
+}
+
+/**
+ * Spawn @param command into the free @param slot with its stdout and stderr
+ * on fresh pipes, and register the pipes and its pidfd with @param epfd.
+ * @return true if the command was started.
+ */
+static bool batch_start(int epfd, struct batch_slot *slots, size_t slot, size_t job, char *const command[])
+{
+    struct batch_slot *s = &slots[slot];
+    posix_spawn_file_actions_t actions;
+    int out[2] = {-1, -1};
+    int err[2] = {-1, -1};
+    pid_t pid;
+    int rc = -1;
+
+    // O_CLOEXEC so concurrently spawned siblings don't hold our write ends open
+    if ((0 == pipe2(out, O_CLOEXEC)) &&
+        (0 == pipe2(err, O_CLOEXEC)) &&
+        (0 == posix_spawn_file_actions_init(&actions)))
+    {
+        if ((0 == posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO)) &&
+            (0 == posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO)))
+        {
+            rc = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+        }
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    // The child has its own copies of the write ends; the read ends are only
+    // kept if it started
+    for (int i = (0 == rc) ? 1 : 0; i < 2; i++)
+    {
+        if (-1 != out[i])
+        {
+            close(out[i]);
+        }
+        if (-1 != err[i])
+        {
+            close(err[i]);
+        }
+    }
+    if (0 != rc)
+    {
+        return false;
+    }
+
+    memset(s, 0, sizeof(struct batch_slot));
+    s->pid = pid;
+    s->job = job;
+    s->fds[BATCH_OUT] = out[0];
+    s->fds[BATCH_ERR] = err[0];
+    s->pidfd = batch_pidfd_open(pid);
+    for (int i = BATCH_OUT; i <= BATCH_ERR; i++)
+    {
+        fcntl(s->fds[i], F_SETFL, O_NONBLOCK);
+        batch_watch(epfd, &s->fds[i], slot, (enum batch_source)i);
+    }
+    if (-1 != s->pidfd)
+    {
+        batch_watch(epfd, &s->pidfd, slot, BATCH_PIDFD);
+    }
+    return true;
+}
+
+/**
+ * Read everything currently available on @param fd onto the end of
+ * @param buf.
+ * @return false once the pipe is at EOF or failed, true if more may follow.
+ */
+static bool batch_drain(int fd, char **buf, size_t *len, size_t *cap)
+{
+    ssize_t n;
+    char *grown;
+
+    while (true)
+    {
+        if (*cap - *len < BATCH_READ_CHUNK)
+        {
+            size_t newcap = (0 == *cap) ? BATCH_READ_CHUNK : *cap * 2;
+            grown = realloc(*buf, newcap);
+            if (NULL == grown)
+            {
+                return false;
+            }
+            *buf = grown;
+            *cap = newcap;
+        }
+        n = read(fd, *buf + *len, *cap - *len - 1); // Room for the NUL
+        if (n > 0)
+        {
+            *len += (size_t)n;
+            (*buf)[*len] = '\0';
+        }
+        else if (0 == n)
+        {
+            return false;
+        }
+        else if (EINTR != errno)
+        {
+            return (EAGAIN == errno);
+        }
+    }
+}
+
+static void batch_reap(struct batch_slot *s, struct exec_result *r, int options)
+{
+    pid_t rc;
+
+    do
+    {
+        rc = waitpid(s->pid, &r->status, options);
+    } while ((-1 == rc) && (EINTR == errno));
 
-    cpid = fork();
-    switch (cpid)
+    if (0 != rc)
+    {
+        s->exited = true;
+        r->success = (-1 != rc) && exit_success(r->status);
+    }
+}
+
+/**
+ * @return true once @param s has exited and both its pipes hit EOF, after
+ * releasing the slot and trimming empty outputs to NULL.
+ */
+static bool batch_finish(int epfd, struct batch_slot *s, struct exec_result *r)
+{
+    if (!s->exited || (-1 != s->fds[BATCH_OUT]) || (-1 != s->fds[BATCH_ERR]))
     {
-    case -1:
         return false;
-    case 0:
-        fd = open(outputfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
-        if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+    }
+    if (-1 != s->pidfd)
+    {
+        batch_unwatch(epfd, &s->pidfd);
+    }
+    if (0 == r->out_len)
+    {
+        free(r->out);
+        r->out = NULL;
+    }
+    if (0 == r->err_len)
+    {
+        free(r->err);
+        r->err = NULL;
+    }
+    s->pid = 0;
+    return true;
+}
+
+size_t do_exec_batch(char *const *const commands[], size_t ncommands, size_t parallel,
+                     struct exec_result results[])
+{
+    struct epoll_event events[BATCH_MAX_EVENTS];
+    struct batch_slot *slots;
+    size_t nslots = parallel;
+    size_t next = 0;
+    size_t running = 0;
+    size_t succeeded = 0;
+    int epfd;
+    int timeout;
+    int n;
+
+    for (size_t i = 0; i < ncommands; i++)
+    {
+        memset(&results[i], 0, sizeof(struct exec_result));
+        results[i].status = -1;
+    }
+    if (0 == nslots)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nslots = (cpus > 0) ? (size_t)cpus : 1;
+    }
+    if (nslots > ncommands)
+    {
+        nslots = ncommands;
+    }
+    if (0 == nslots)
+    {
+        return 0;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == epfd)
+    {
+        return 0;
+    }
+    slots = calloc(nslots, sizeof(struct batch_slot));
+    if (NULL == slots)
+    {
+        close(epfd);
+        return 0;
+    }
+
+    while ((next < ncommands) || (running > 0))
+    {
+        // Top up free slots, skipping commands which fail to start
+        for (size_t s = 0; (s < nslots) && (next < ncommands); s++)
         {
-            exit(EXIT_FAILURE);
+            while ((0 == slots[s].pid) && (next < ncommands))
+            {
+                if (batch_start(epfd, slots, s, next, commands[next]))
+                {
+                    running++;
+                }
+                next++;
+            }
         }
-        close(fd);
-        execv(command[0], command);
-        exit(errno);
-    default:
-        ppid = waitpid(cpid, &status, 0);
-        return ((ppid != -1) &&
-                !WIFSIGNALED(status) &&
-                !WIFSTOPPED(status) &&
-                (WIFEXITED(status) && 0 == WEXITSTATUS(status)));
+        if (0 == running)
+        {
+            continue;
+        }
+
+        // Only children without a pidfd whose pipes are closed need polling
+        timeout = -1;
+        for (size_t s = 0; s < nslots; s++)
+        {
+            if ((0 != slots[s].pid) && !slots[s].exited && (-1 == slots[s].pidfd) &&
+                (-1 == slots[s].fds[BATCH_OUT]) && (-1 == slots[s].fds[BATCH_ERR]))
+            {
+                timeout = BATCH_REAP_POLL_MS;
+            }
+        }
+
+        n = epoll_wait(epfd, events, BATCH_MAX_EVENTS, timeout);
+        if ((-1 == n) && (EINTR != errno))
+        {
+            break;
+        }
+        for (int e = 0; e < n; e++)
+        {
+            struct batch_slot *s = &slots[events[e].data.u64 >> 2];
+            struct exec_result *r = &results[s->job];
+            enum batch_source source = (enum batch_source)(events[e].data.u64 & 3);
+
+            if (BATCH_PIDFD == source)
+            {
+                batch_reap(s, r, 0);
+                batch_unwatch(epfd, &s->pidfd); // Stays readable once exited
+            }
+            else if (!batch_drain(s->fds[source],
+                                  (BATCH_OUT == source) ? &r->out : &r->err,
+                                  (BATCH_OUT == source) ? &r->out_len : &r->err_len,
+                                  &s->caps[source]))
+            {
+                batch_unwatch(epfd, &s->fds[source]);
+            }
+        }
+
+        for (size_t s = 0; s < nslots; s++)
+        {
+            if (0 == slots[s].pid)
+            {
+                continue;
+            }
+            if (!slots[s].exited && (-1 == slots[s].pidfd))
+            {
+                batch_reap(&slots[s], &results[slots[s].job], WNOHANG);
+            }
+            if (batch_finish(epfd, &slots[s], &results[slots[s].job]))
+            {
+                succeeded += results[slots[s].job].success ? 1 : 0;
+                running--;
+            }
+        }
+    }
+
+    // Only reached with children still running if epoll failed
+    for (size_t s = 0; s < nslots; s++)
+    {
+        if (0 != slots[s].pid)
+        {
+            for (int i = BATCH_OUT; i <= BATCH_ERR; i++)
+            {
+                if (-1 != slots[s].fds[i])
+                {
+                    batch_unwatch(epfd, &slots[s].fds[i]);
+                }
+            }
+            if (!slots[s].exited)
+            {
+                batch_reap(&slots[s], &results[slots[s].job], 0);
+            }
+            results[slots[s].job].success = false;
+            batch_finish(epfd, &slots[s], &results[slots[s].job]);
+        }
+    }
+
+    free(slots);
+    close(epfd);
+    return succeeded;
+}
+
+void exec_results_free(struct exec_result results[], size_t nresults)
+{
+    for (size_t i = 0; i < nresults; i++)
+    {
+        free(results[i].out);
+        free(results[i].err);
+        results[i].out = results[i].err = NULL;
+        results[i].out_len = results[i].err_len = 0;
     }
 }
@@ -7,3 +7,56 @@ bool do_system(const char *command);
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+enum exec_backend
+{
+    EXEC_BACKEND_FORK,  // fork() + execv(), copies the parent's page tables
+    EXEC_BACKEND_SPAWN, // posix_spawn(), no copy (default)
+};
+
+/**
+ * Select how do_exec and do_exec_redirect start commands. Both backends have
+ * the same return semantics.
+ */
+void set_exec_backend(enum exec_backend backend);
+
+/**
+ * Outcome of one command run by do_exec_batch.
+ */
+struct exec_result
+{
+    /**
+     * true under the same conditions do_exec would return true
+     */
+    bool success;
+    /**
+     * Raw waitpid() status, or -1 if the command could not be started
+     */
+    int status;
+    /**
+     * Captured stdout and stderr, NUL terminated for convenience. NULL if
+     * the stream produced no output.
+     */
+    char *out;
+    size_t out_len;
+    char *err;
+    size_t err_len;
+};
+
+/**
+ * Run @param ncommands commands, keeping up to @param parallel of them
+ * running at once (0 for one per online CPU). Each entry of
+ * @param commands is a NULL terminated argv whose first element is an
+ * absolute path, as for do_exec. Each child's stdout and stderr are captured
+ * into @param results, which must hold @param ncommands entries and later be
+ * released with exec_results_free. Commands are always started with
+ * posix_spawn, whatever set_exec_backend selected.
+ * @return the number of commands which succeeded.
+ */
+size_t do_exec_batch(char *const *const commands[], size_t ncommands, size_t parallel,
+                     struct exec_result results[]);
+
+/**
+ * Free the output buffers held by @param results from do_exec_batch.
+ */
+void exec_results_free(struct exec_result results[], size_t nresults);
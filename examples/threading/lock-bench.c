@@ -0,0 +1,484 @@
+/*
+ * Lock contention benchmark.
+ *
+ * Every thread repeatedly acquires a shared lock, holds it for a busy-waited
+ * hold time, releases it and optionally waits a think time before trying
+ * again. Acquire latency (call to lock returned) is recorded for every
+ * acquisition and reported as percentiles per lock, thread count and hold
+ * time. With --jobs it instead compares a thread per
+ * start_thread_obtaining_mutex job against the same jobs on a thread pool.
+ */
+#define _GNU_SOURCE // PTHREAD_MUTEX_ADAPTIVE_NP
+
+#include <errno.h>
+#include <getopt.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "threading.h"
+#include "threadpool.h"
+
+#define MAX_LIST 16
+
+static const struct option longopts[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"threads", required_argument, NULL, 't'},
+    {"hold", required_argument, NULL, 'H'},
+    {"think", required_argument, NULL, 'T'},
+    {"iterations", required_argument, NULL, 'n'},
+    {"jobs", required_argument, NULL, 'j'},
+    {NULL, 0, NULL, 0}};
+static const char *optstring = "ht:H:T:n:j:";
+
+static void print_help(void)
+{
+    printf("lock-bench - lock acquire latency under contention\n");
+    printf("\n");
+    printf("Usage: lock-bench [options]\n");
+    printf("\n");
+    printf("Options:\n");
+    printf(" --help, -h               Print this help and exit\n");
+    printf(" --threads, -t <N,...>    Thread counts. (Default: 1,2,4,8)\n");
+    printf(" --hold, -H <NS,...>      Hold times in ns. (Default: 0,100,1000)\n");
+    printf(" --think, -T <NS>         Time between release and next acquire. (Default: 100)\n");
+    printf(" --iterations, -n <N>     Acquisitions per thread. (Default: 20000)\n");
+    printf(" --jobs, -j <N>           Instead, time N mutex jobs thread-per-job vs pooled\n");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void spin_ns(uint64_t ns)
+{
+    if (0 != ns)
+    {
+        uint64_t until = now_ns() + ns;
+        while (now_ns() < until)
+        {
+        }
+    }
+}
+
+// ==== Futex lock ============================================================
+// Drepper's three state mutex: 0 unlocked, 1 locked, 2 locked with waiters
+
+static void futex_lock(uint32_t *f)
+{
+    uint32_t c = 0;
+    if (__atomic_compare_exchange_n(f, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    if (2 != c)
+    {
+        c = __atomic_exchange_n(f, 2, __ATOMIC_ACQUIRE);
+    }
+    while (0 != c)
+    {
+        syscall(SYS_futex, f, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        c = __atomic_exchange_n(f, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void futex_unlock(uint32_t *f)
+{
+    if (1 != __atomic_fetch_sub(f, 1, __ATOMIC_RELEASE))
+    {
+        __atomic_store_n(f, 0, __ATOMIC_RELEASE);
+        syscall(SYS_futex, f, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+// ==== Lock table ============================================================
+
+enum lock_kind
+{
+    LOCK_MUTEX,
+    LOCK_ADAPTIVE,
+    LOCK_SPIN,
+    LOCK_FUTEX,
+    LOCK_KINDS,
+};
+
+static const char *lock_names[LOCK_KINDS] = {"mutex", "adaptive", "spinlock", "futex"};
+
+struct bench_lock
+{
+    enum lock_kind kind;
+    pthread_mutex_t mutex;
+    pthread_spinlock_t spin;
+    uint32_t futex;
+};
+
+static void bench_lock_init(struct bench_lock *lock, enum lock_kind kind)
+{
+    pthread_mutexattr_t attr;
+
+    lock->kind = kind;
+    lock->futex = 0;
+    pthread_mutexattr_init(&attr);
+    if (LOCK_ADAPTIVE == kind)
+    {
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    }
+    pthread_mutex_init(&lock->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_spin_init(&lock->spin, PTHREAD_PROCESS_PRIVATE);
+}
+
+static void bench_lock_destroy(struct bench_lock *lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+    pthread_spin_destroy(&lock->spin);
+}
+
+static inline void bench_lock_acquire(struct bench_lock *lock)
+{
+    switch (lock->kind)
+    {
+    case LOCK_SPIN:
+        pthread_spin_lock(&lock->spin);
+        break;
+    case LOCK_FUTEX:
+        futex_lock(&lock->futex);
+        break;
+    default:
+        pthread_mutex_lock(&lock->mutex);
+        break;
+    }
+}
+
+static inline void bench_lock_release(struct bench_lock *lock)
+{
+    switch (lock->kind)
+    {
+    case LOCK_SPIN:
+        pthread_spin_unlock(&lock->spin);
+        break;
+    case LOCK_FUTEX:
+        futex_unlock(&lock->futex);
+        break;
+    default:
+        pthread_mutex_unlock(&lock->mutex);
+        break;
+    }
+}
+
+// ==== Contention run ========================================================
+
+struct run
+{
+    struct bench_lock lock;
+    pthread_barrier_t start;
+    uint64_t hold_ns;
+    uint64_t think_ns;
+    size_t iterations;
+    uint64_t *latencies; // iterations per thread, back to back
+    uint64_t shared;     // Touched under the lock so the critical section is real
+};
+
+struct worker
+{
+    struct run *run;
+    uint64_t *latencies;
+    uint64_t start;
+    uint64_t end;
+};
+
+static void *contend(void *param)
+{
+    struct worker *w = (struct worker *)param;
+    struct run *run = w->run;
+
+    pthread_barrier_wait(&run->start);
+    w->start = now_ns();
+    for (size_t i = 0; i < run->iterations; i++)
+    {
+        uint64_t t0 = now_ns();
+        bench_lock_acquire(&run->lock);
+        w->latencies[i] = now_ns() - t0;
+        run->shared++;
+        spin_ns(run->hold_ns);
+        bench_lock_release(&run->lock);
+        spin_ns(run->think_ns);
+    }
+    w->end = now_ns();
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+    size_t idx = (size_t)(p * (double)(n - 1));
+    return sorted[idx];
+}
+
+static int run_contention(enum lock_kind kind, size_t nthreads, uint64_t hold_ns, uint64_t think_ns, size_t iterations)
+{
+    struct run run = {.hold_ns = hold_ns, .think_ns = think_ns, .iterations = iterations, .shared = 0};
+    size_t total = nthreads * iterations;
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    struct worker *workers = calloc(nthreads, sizeof(struct worker));
+    uint64_t start = UINT64_MAX, end = 0, elapsed;
+
+    if (0 == total)
+    {
+        free(workers);
+        free(threads);
+        return 0; // Nothing to measure
+    }
+    run.latencies = calloc(total, sizeof(uint64_t));
+    if ((NULL == threads) || (NULL == workers) || (NULL == run.latencies))
+    {
+        perror("failed to allocate run");
+        free(run.latencies);
+        free(workers);
+        free(threads);
+        return -1;
+    }
+    bench_lock_init(&run.lock, kind);
+    pthread_barrier_init(&run.start, NULL, (unsigned)nthreads + 1);
+
+    for (size_t i = 0; i < nthreads; i++)
+    {
+        workers[i].run = &run;
+        workers[i].latencies = run.latencies + (i * iterations);
+        if (0 != pthread_create(&threads[i], NULL, contend, &workers[i]))
+        {
+            perror("failed to start worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait(&run.start);
+    // Span of the workers themselves, this thread may not even be scheduled
+    for (size_t i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+        start = (workers[i].start < start) ? workers[i].start : start;
+        end = (workers[i].end > end) ? workers[i].end : end;
+    }
+    elapsed = (end > start) ? (end - start) : 1;
+
+    qsort(run.latencies, total, sizeof(uint64_t), cmp_u64);
+    printf("%-9s %7zu %8lu %12.0f %8lu %8lu %8lu %9lu %10lu\n",
+           lock_names[kind], nthreads, (unsigned long)hold_ns,
+           (double)total * 1e9 / (double)elapsed,
+           (unsigned long)percentile(run.latencies, total, 0.50),
+           (unsigned long)percentile(run.latencies, total, 0.90),
+           (unsigned long)percentile(run.latencies, total, 0.99),
+           (unsigned long)percentile(run.latencies, total, 0.999),
+           (unsigned long)run.latencies[total - 1]);
+
+    pthread_barrier_destroy(&run.start);
+    bench_lock_destroy(&run.lock);
+    free(run.latencies);
+    free(workers);
+    free(threads);
+    return 0;
+}
+
+// ==== Job dispatch ==========================================================
+
+static void run_jobs(size_t njobs)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct thread_future **futures = calloc(njobs, sizeof(struct thread_future *));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct threadpool *pool;
+    uint64_t start, elapsed;
+    size_t failed = 0;
+
+    if (NULL == futures)
+    {
+        perror("failed to allocate futures");
+        exit(EXIT_FAILURE);
+    }
+
+    // Same zero-wait jobs both ways, so only the dispatch overhead differs
+    start = now_ns();
+    for (size_t i = 0; i < njobs; i++)
+    {
+        pthread_t thread;
+        void *rtn = NULL;
+        if (!start_thread_obtaining_mutex(&thread, &mutex, 0, 0) || (0 != pthread_join(thread, &rtn)))
+        {
+            failed++;
+            continue;
+        }
+        failed += ((struct thread_data *)rtn)->thread_complete_success ? 0 : 1;
+        free(rtn);
+    }
+    elapsed = now_ns() - start;
+    printf("%-16s %8zu jobs %10.2f us/job %6zu failed\n", "thread-per-job", njobs,
+           (double)elapsed / 1e3 / (double)njobs, failed);
+
+    pool = threadpool_create((cpus > 0) ? (size_t)cpus : 1);
+    if (NULL == pool)
+    {
+        fprintf(stderr, "failed to start thread pool\n");
+        exit(EXIT_FAILURE);
+    }
+    failed = 0;
+    start = now_ns();
+    for (size_t i = 0; i < njobs; i++)
+    {
+        futures[i] = threadpool_submit_obtaining_mutex(pool, &mutex, 0, 0);
+    }
+    for (size_t i = 0; i < njobs; i++)
+    {
+        failed += ((NULL != futures[i]) && thread_future_wait(futures[i])) ? 0 : 1;
+    }
+    elapsed = now_ns() - start;
+    printf("%-16s %8zu jobs %10.2f us/job %6zu failed\n", "threadpool", njobs,
+           (double)elapsed / 1e3 / (double)njobs, failed);
+
+    threadpool_destroy(pool);
+    free(futures);
+}
+
+// Parse a whole number, rejecting trailing junk and, unless allowed, zero
+static bool parse_u64(const char *arg, bool allow_zero, uint64_t *out)
+{
+    char *end = NULL;
+
+    if (('\0' == *arg) || ('-' == *arg))
+    {
+        return false;
+    }
+    errno = 0;
+    *out = strtoull(arg, &end, 0);
+    return (0 == errno) && ('\0' == *end) && (allow_zero || (0 != *out));
+}
+
+// @return entries parsed into out, or 0 if any of them is invalid
+static size_t parse_list(const char *arg, bool allow_zero, uint64_t *out)
+{
+    size_t n = 0;
+    char *copy = strdup(arg);
+    char *save = NULL;
+
+    if (NULL == copy)
+    {
+        return 0;
+    }
+    for (char *tok = strtok_r(copy, ",", &save); NULL != tok; tok = strtok_r(NULL, ",", &save))
+    {
+        if ((n >= MAX_LIST) || !parse_u64(tok, allow_zero, &out[n++]))
+        {
+            n = 0;
+            break;
+        }
+    }
+    free(copy);
+    return n;
+}
+
+static void usage_error(const char *what, const char *arg)
+{
+    fprintf(stderr, "Invalid %s '%s'\n\n", what, arg);
+    print_help();
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t threads[MAX_LIST] = {1, 2, 4, 8};
+    uint64_t holds[MAX_LIST] = {0, 100, 1000};
+    size_t nthreads = 4, nholds = 3;
+    uint64_t think_ns = 100;
+    size_t iterations = 20000;
+    size_t njobs = 0;
+    uint64_t value;
+    int opt;
+
+    while (-1 != (opt = getopt_long(argc, argv, optstring, longopts, 0)))
+    {
+        switch (opt)
+        {
+        case 'h':
+            print_help();
+            exit(EXIT_SUCCESS);
+        case 't':
+            if (0 == (nthreads = parse_list(optarg, false, threads)))
+            {
+                usage_error("thread counts", optarg);
+            }
+            break;
+        case 'H':
+            // A zero hold is still a lock round trip, only counts must be > 0
+            if (0 == (nholds = parse_list(optarg, true, holds)))
+            {
+                usage_error("hold times", optarg);
+            }
+            break;
+        case 'T':
+            if (!parse_u64(optarg, true, &think_ns))
+            {
+                usage_error("think time", optarg);
+            }
+            break;
+        case 'n':
+            if (!parse_u64(optarg, false, &value))
+            {
+                usage_error("iteration count", optarg);
+            }
+            iterations = (size_t)value;
+            break;
+        case 'j':
+            if (!parse_u64(optarg, false, &value))
+            {
+                usage_error("job count", optarg);
+            }
+            njobs = (size_t)value;
+            break;
+        default:
+            print_help();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (0 != njobs)
+    {
+        run_jobs(njobs);
+        return EXIT_SUCCESS;
+    }
+    if ((0 == iterations) || (0 == nthreads) || (0 == nholds))
+    {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-9s %7s %8s %12s %8s %8s %8s %9s %10s\n",
+           "lock", "threads", "hold_ns", "acq/s", "p50_ns", "p90_ns", "p99_ns", "p99.9_ns", "max_ns");
+    for (size_t h = 0; h < nholds; h++)
+    {
+        for (size_t t = 0; t < nthreads; t++)
+        {
+            for (int k = 0; k < LOCK_KINDS; k++)
+            {
+                if (0 != run_contention((enum lock_kind)k, (size_t)threads[t], holds[h], think_ns, iterations))
+                {
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
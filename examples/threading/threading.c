@@ -1,5 +1,5 @@
 #include "threading.h"
-#include <unistd.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -8,14 +8,52 @@
 // #define DEBUG_LOG(msg, ...) printf("threading: " msg "\n", ##__VA_ARGS__)
 #define ERROR_LOG(msg, ...) printf("threading ERROR: " msg "\n", ##__VA_ARGS__)
 
+void deadline_add_ms(struct timespec *deadline, int ms)
+{
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+int sleep_until(const struct timespec *deadline)
+{
+    int rc;
+    // Absolute deadline, so an interrupted sleep just picks up where it was
+    while (EINTR == (rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL)))
+    {
+    }
+    return rc;
+}
+
+// Deadline-based, so the wait can't come up short and only overshoots by the
+// wakeup latency
+static int sleep_ms(int ms)
+{
+    struct timespec deadline;
+    if (ms <= 0)
+    {
+        return 0; // Even an already expired deadline costs a trip through timer slack
+    }
+    if (0 != clock_gettime(CLOCK_MONOTONIC, &deadline))
+    {
+        return errno;
+    }
+    deadline_add_ms(&deadline, ms);
+    return sleep_until(&deadline);
+}
+
 void *threadfunc(void *thread_param)
 {
     struct thread_data *t_data = (struct thread_data *)thread_param;
     t_data->thread_complete_success = false; // short circuit false
 
-    if ((0 != usleep(t_data->wait_to_obtain_ms * 1000)) ||
+    if ((0 != sleep_ms(t_data->wait_to_obtain_ms)) ||
         (0 != pthread_mutex_lock(t_data->mutex)) ||
-        (0 != usleep(t_data->wait_to_release_ms * 1000)) ||
+        (0 != sleep_ms(t_data->wait_to_release_ms)) ||
         (0 != pthread_mutex_unlock(t_data->mutex)))
     {
         return thread_param;
@@ -1,5 +1,9 @@
+#ifndef THREADING_H
+#define THREADING_H
+
 #include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
 
 /**
  * This structure should be dynamically allocated and passed as
@@ -30,3 +34,25 @@ struct thread_data
  * @return true if the thread could be started, false if a failure occurred.
  */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+ * Advance @param deadline, a CLOCK_MONOTONIC time, by @param ms milliseconds.
+ */
+void deadline_add_ms(struct timespec *deadline, int ms);
+
+/**
+ * Sleep until the absolute CLOCK_MONOTONIC time @param deadline using
+ * clock_nanosleep() with TIMER_ABSTIME, resuming after signals without
+ * drifting.
+ * @return 0 once the deadline has passed, an errno value on failure.
+ */
+int sleep_until(const struct timespec *deadline);
+
+/**
+ * The thread body used by start_thread_obtaining_mutex, which can also be run
+ * directly (e.g. by a thread pool) on a caller-owned @param thread_param.
+ * @return @param thread_param
+ */
+void *threadfunc(void *thread_param);
+
+#endif /* THREADING_H */
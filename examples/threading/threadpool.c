@@ -0,0 +1,194 @@
+#include "threadpool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/queue.h>
+
+struct thread_future
+{
+    struct thread_data data;
+    bool done;
+    /**
+     * Signalled under the pool lock once done is set
+     */
+    pthread_cond_t cond;
+    struct threadpool *pool;
+    STAILQ_ENTRY(thread_future)
+    entries;
+};
+
+STAILQ_HEAD(future_list, thread_future);
+
+struct threadpool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct future_list queue;
+    /**
+     * Futures handed back by thread_future_wait, reused before allocating
+     */
+    struct future_list spare;
+    bool stopping;
+    size_t nworkers;
+    pthread_t *workers;
+};
+
+static void *threadpool_worker(void *pool_param)
+{
+    struct threadpool *pool = (struct threadpool *)pool_param;
+    struct thread_future *future;
+
+    // Default 50us of timer slack would swamp short deadline-based waits
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (true)
+    {
+        while (!pool->stopping && STAILQ_EMPTY(&pool->queue))
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (STAILQ_EMPTY(&pool->queue))
+        {
+            break; // Stopping and drained
+        }
+        future = STAILQ_FIRST(&pool->queue);
+        STAILQ_REMOVE_HEAD(&pool->queue, entries);
+        pthread_mutex_unlock(&pool->lock);
+
+        threadfunc(&future->data);
+
+        pthread_mutex_lock(&pool->lock);
+        future->done = true;
+        pthread_cond_signal(&future->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct threadpool *threadpool_create(size_t nworkers)
+{
+    struct threadpool *pool;
+
+    if (0 == nworkers)
+    {
+        return NULL;
+    }
+    pool = malloc(sizeof(struct threadpool));
+    if (NULL == pool)
+    {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(struct threadpool));
+    STAILQ_INIT(&pool->queue);
+    STAILQ_INIT(&pool->spare);
+
+    pool->workers = calloc(nworkers, sizeof(pthread_t));
+    if ((NULL == pool->workers) ||
+        (0 != pthread_mutex_init(&pool->lock, NULL)) ||
+        (0 != pthread_cond_init(&pool->work, NULL)))
+    {
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+
+    for (pool->nworkers = 0; pool->nworkers < nworkers; pool->nworkers++)
+    {
+        if (0 != pthread_create(&pool->workers[pool->nworkers], NULL, threadpool_worker, pool))
+        {
+            threadpool_destroy(pool); // Stops the ones that did start
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+struct thread_future *threadpool_submit_obtaining_mutex(struct threadpool *pool, pthread_mutex_t *mutex,
+                                                        int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    struct thread_future *future;
+
+    pthread_mutex_lock(&pool->lock);
+    future = STAILQ_FIRST(&pool->spare);
+    if (NULL != future)
+    {
+        STAILQ_REMOVE_HEAD(&pool->spare, entries);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (NULL == future)
+    {
+        future = malloc(sizeof(struct thread_future));
+        if (NULL == future)
+        {
+            return NULL;
+        }
+        if (0 != pthread_cond_init(&future->cond, NULL))
+        {
+            free(future);
+            return NULL;
+        }
+        future->pool = pool;
+    }
+
+    future->data.wait_to_obtain_ms = wait_to_obtain_ms;
+    future->data.wait_to_release_ms = wait_to_release_ms;
+    future->data.mutex = mutex;
+    future->data.thread_complete_success = false;
+    future->done = false;
+
+    pthread_mutex_lock(&pool->lock);
+    STAILQ_INSERT_TAIL(&pool->queue, future, entries);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return future;
+}
+
+bool thread_future_wait(struct thread_future *future)
+{
+    struct threadpool *pool = future->pool;
+    bool success;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!future->done)
+    {
+        pthread_cond_wait(&future->cond, &pool->lock);
+    }
+    success = future->data.thread_complete_success;
+    STAILQ_INSERT_HEAD(&pool->spare, future, entries); // Hot in cache for the next submit
+    pthread_mutex_unlock(&pool->lock);
+    return success;
+}
+
+void threadpool_destroy(struct threadpool *pool)
+{
+    struct thread_future *future;
+
+    if (NULL == pool)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->nworkers; i++)
+    {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    while (NULL != (future = STAILQ_FIRST(&pool->spare)))
+    {
+        STAILQ_REMOVE_HEAD(&pool->spare, entries);
+        pthread_cond_destroy(&future->cond);
+        free(future);
+    }
+
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,45 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "threading.h"
+
+struct threadpool;
+struct thread_future;
+
+/**
+ * Start a pool of @param nworkers threads which run submitted jobs in FIFO
+ * order. Workers and futures are reused, so once warm a submit costs neither
+ * a thread creation nor a malloc.
+ * @return the pool, or NULL if it could not be started.
+ */
+struct threadpool *threadpool_create(size_t nworkers);
+
+/**
+ * Queue the same job as start_thread_obtaining_mutex: sleep
+ * @param wait_to_obtain_ms milliseconds, obtain @param mutex, hold it for
+ * @param wait_to_release_ms milliseconds, then release it. The job occupies a
+ * worker for its whole duration.
+ * @return a future to pass to thread_future_wait, or NULL if the job could
+ * not be queued.
+ */
+struct thread_future *threadpool_submit_obtaining_mutex(struct threadpool *pool, pthread_mutex_t *mutex,
+                                                        int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+ * Block until the job behind @param future has run, then hand the future
+ * back to its pool. @param future must not be used afterwards.
+ * @return the job's thread_complete_success.
+ */
+bool thread_future_wait(struct thread_future *future);
+
+/**
+ * Run every queued job, stop the workers and free the pool. All futures must
+ * have been waited on first.
+ */
+void threadpool_destroy(struct threadpool *pool);
+
+#endif /* THREADPOOL_H */
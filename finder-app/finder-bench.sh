@@ -0,0 +1,47 @@
+#!/bin/sh
+# Compare finder.sh against the compiled finder on a generated tree
+#  Usage: finder-bench.sh [DIRS [FILES_PER_DIR [LINES_PER_FILE]]]
+
+set -e
+set -u
+
+CURDIR="$(realpath "$(dirname "$0")" || echo ".")"
+NUMDIRS="${1:-100}"
+NUMFILES="${2:-100}"
+NUMLINES="${3:-50}"
+SEARCHSTR=AELD_IS_FUN
+BENCHDIR=/tmp/aeld-finder-bench
+
+[ -x "${CURDIR}/finder" ] || { >&2 echo "Build finder first (make)"; exit 1; }
+
+echo "Generating ${NUMDIRS} dirs of ${NUMFILES} files of ${NUMLINES} lines in ${BENCHDIR}"
+rm -rf "${BENCHDIR}"
+# Every tenth line matches
+CONTENT="$(seq 1 "${NUMLINES}" | sed "s/^\(.*0\)$/\1 ${SEARCHSTR}/; s/^[0-9]*[1-9]$/& filler text/")"
+for d in $(seq 1 "${NUMDIRS}"); do
+	DIR="${BENCHDIR}/d$((d % 10))/s${d}"
+	mkdir -p "${DIR}"
+	for f in $(seq 1 "${NUMFILES}"); do
+		echo "${CONTENT}" > "${DIR}/f${f}.txt"
+	done
+done
+
+now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
+bench() {
+	NAME="$1"
+	shift
+	# Drop the first, cold-cache run
+	"$@" "${BENCHDIR}" "${SEARCHSTR}" > /dev/null
+	START="$(now_ms)"
+	OUTPUT="$("$@" "${BENCHDIR}" "${SEARCHSTR}")"
+	echo "${NAME}: $(($(now_ms) - START)) ms: ${OUTPUT}"
+}
+
+bench "finder.sh " "${CURDIR}/finder.sh"
+bench "finder -j1" "${CURDIR}/finder" -j 1
+bench "finder    " "${CURDIR}/finder"
+
+rm -rf "${BENCHDIR}"
@@ -56,9 +56,16 @@ fi
 # make clean
 # make
 
-for i in $(seq 1 "${NUMFILES}"); do
-	${WRITER} "${WRITEDIR}/${username}$i.txt" "${WRITESTR}"
-done
+if [ "${WRITER}" = "writer" ]; then
+	# The compiled writer takes every file in one process
+	for i in $(seq 1 "${NUMFILES}"); do
+		printf '%s\0%s\0' "${WRITEDIR}/${username}$i.txt" "${WRITESTR}"
+	done | ${WRITER} --batch --null
+else
+	for i in $(seq 1 "${NUMFILES}"); do
+		${WRITER} "${WRITEDIR}/${username}$i.txt" "${WRITESTR}"
+	done
+fi
 
 OUTPUTSTRING="$(${FINDER} "${WRITEDIR}" "${WRITESTR}")"
 echo "${OUTPUTSTRING}" > /tmp/assignment4-result.txt
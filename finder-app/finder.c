@@ -0,0 +1,570 @@
+/*
+ * ianmclinden, 2024
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#define DENTS_BUF_SIZE (64 * 1024)
+/**
+ * Files at most this big are read into the worker's buffer, bigger ones are
+ * mapped
+ */
+#define READ_MAX_SIZE (256 * 1024)
+/**
+ * Like GNU grep, a NUL byte in this much of the head marks a file as binary.
+ * grep reports binary matches on stderr, so they add no lines.
+ */
+#define BINARY_PROBE_SIZE (32 * 1024)
+/**
+ * Files of a directory are queued in stealable batches of this many
+ */
+#define FILES_PER_WORK 32
+/**
+ * Basic regular expression metacharacters; patterns without any take the
+ * memmem() path
+ */
+#define BRE_SPECIAL "\\.[*^$"
+
+enum work_kind
+{
+    WORK_DIR,
+    WORK_FILES,
+};
+
+/**
+ * A directory to walk, or a batch of regular files within one
+ */
+struct work
+{
+    TAILQ_ENTRY(work)
+    entries;
+    enum work_kind kind;
+    size_t nnames;
+    /**
+     * Directory path, then for WORK_FILES nnames NUL terminated file names
+     */
+    char data[];
+};
+
+TAILQ_HEAD(work_queue, work);
+
+struct worker
+{
+    pthread_t thread;
+    /**
+     * Owner pushes and pops at the tail, thieves take from the head where
+     * the oldest, biggest subtrees are
+     */
+    pthread_mutex_t lock;
+    struct work_queue queue;
+    regex_t regex; // Per worker, glibc serialises regexec on a shared one
+    char *buf;
+    size_t bufsize;
+    char *names; // FILES_PER_WORK batch being filled
+    size_t names_len;
+    size_t names_cap;
+    size_t nnames;
+    size_t files;
+    size_t lines;
+};
+
+static struct worker *workers;
+static size_t nworkers;
+static const char *searchstr;
+static size_t searchlen;
+static bool use_regex;
+
+/**
+ * Items queued, and items queued or being processed. The walk is over once
+ * pending drops to 0.
+ */
+static atomic_size_t queued;
+static atomic_size_t pending;
+static atomic_size_t nidle;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+void print_help()
+{
+    printf("finder - count files and lines matching a pattern under a directory\n");
+    printf("\n");
+    printf("Usage: finder [options] <FILESDIR> <SEARCHSTR>\n");
+    printf("\n");
+    printf("Same output as finder.sh, in one parallel pass over FILESDIR. SEARCHSTR is\n");
+    printf("a basic regular expression, as for grep.\n");
+    printf("\n");
+    printf("Options:\n");
+    printf(" --help,-h              Print this help and exit\n");
+    printf(" --jobs, -j <N>         Search with N threads. (Default: CPUs)\n");
+}
+
+static void work_push(struct worker *self, enum work_kind kind, const char *dir, size_t dirlen,
+                      const char *names, size_t names_len, size_t nnames)
+{
+    struct work *work = malloc(sizeof(struct work) + dirlen + 1 + names_len);
+
+    if (NULL == work)
+    {
+        perror("failed to queue work");
+        return;
+    }
+    work->kind = kind;
+    work->nnames = nnames;
+    memcpy(work->data, dir, dirlen);
+    work->data[dirlen] = '\0';
+    memcpy(work->data + dirlen + 1, names, names_len);
+
+    atomic_fetch_add(&pending, 1);
+    pthread_mutex_lock(&self->lock);
+    TAILQ_INSERT_TAIL(&self->queue, work, entries);
+    pthread_mutex_unlock(&self->lock);
+    atomic_fetch_add(&queued, 1);
+
+    if (0 < atomic_load(&nidle))
+    {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_broadcast(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+static struct work *work_take(struct worker *self)
+{
+    struct work *work;
+    size_t self_idx = (size_t)(self - workers);
+
+    pthread_mutex_lock(&self->lock);
+    work = TAILQ_LAST(&self->queue, work_queue);
+    if (NULL != work)
+    {
+        TAILQ_REMOVE(&self->queue, work, entries);
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    for (size_t i = 1; (NULL == work) && (i < nworkers); i++)
+    {
+        struct worker *victim = &workers[(self_idx + i) % nworkers];
+
+        pthread_mutex_lock(&victim->lock);
+        work = TAILQ_FIRST(&victim->queue);
+        if (NULL != work)
+        {
+            TAILQ_REMOVE(&victim->queue, work, entries);
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    if (NULL != work)
+    {
+        atomic_fetch_sub(&queued, 1);
+    }
+    return work;
+}
+
+/**
+ * @return the number of lines of @param len bytes at @param buf which match.
+ */
+static size_t count_matches(struct worker *self, const char *buf, size_t len)
+{
+    const char *end = buf + len;
+    const char *p = buf;
+    const char *nl;
+    size_t lines = 0;
+
+    if (NULL != memchr(buf, '\0', (len < BINARY_PROBE_SIZE) ? len : BINARY_PROBE_SIZE))
+    {
+        return 0;
+    }
+
+    if (!use_regex)
+    {
+        // Find the next match, count its line, resume on the line after
+        while (NULL != (p = memmem(p, (size_t)(end - p), searchstr, searchlen)))
+        {
+            lines++;
+            nl = memchr(p, '\n', (size_t)(end - p));
+            if (NULL == nl)
+            {
+                break;
+            }
+            p = nl + 1;
+        }
+        return lines;
+    }
+
+    while (p < end)
+    {
+        regmatch_t line;
+
+        nl = memchr(p, '\n', (size_t)(end - p));
+        line.rm_so = 0;
+        line.rm_eo = ((NULL != nl) ? nl : end) - p;
+        if (0 == regexec(&self->regex, p, 1, &line, REG_STARTEND))
+        {
+            lines++;
+        }
+        if (NULL == nl)
+        {
+            break;
+        }
+        p = nl + 1;
+    }
+    return lines;
+}
+
+static void search_file(struct worker *self, int dirfd, const char *dir, const char *name)
+{
+    struct stat st;
+    ssize_t n;
+    size_t len = 0;
+    char *map;
+    int fd;
+
+    self->files++;
+
+    fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY);
+    if ((-1 == fd) || (0 != fstat(fd, &st)))
+    {
+        fprintf(stderr, "finder: %s/%s: %s\n", dir, name, strerror(errno));
+        if (-1 != fd)
+        {
+            close(fd);
+        }
+        return;
+    }
+
+    if (st.st_size > READ_MAX_SIZE)
+    {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (MAP_FAILED != map)
+        {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            self->lines += count_matches(self, map, (size_t)st.st_size);
+            munmap(map, (size_t)st.st_size);
+            close(fd);
+            return;
+        }
+    }
+
+    // Read to EOF rather than trusting st_size, the buffer grows as needed
+    while (true)
+    {
+        if (len == self->bufsize)
+        {
+            char *grown = realloc(self->buf, self->bufsize * 2);
+            if (NULL == grown)
+            {
+                break;
+            }
+            self->buf = grown;
+            self->bufsize *= 2;
+        }
+        n = read(fd, self->buf + len, self->bufsize - len);
+        if (0 < n)
+        {
+            len += (size_t)n;
+        }
+        else if ((0 == n) || (EINTR != errno))
+        {
+            break;
+        }
+    }
+    self->lines += count_matches(self, self->buf, len);
+    close(fd);
+}
+
+/**
+ * Queue the files collected so far in @param self as one stealable batch.
+ */
+static void flush_names(struct worker *self, const char *dir, size_t dirlen)
+{
+    if (0 != self->nnames)
+    {
+        work_push(self, WORK_FILES, dir, dirlen, self->names, self->names_len, self->nnames);
+        self->names_len = 0;
+        self->nnames = 0;
+    }
+}
+
+static void add_name(struct worker *self, const char *dir, size_t dirlen, const char *name)
+{
+    size_t len = strlen(name) + 1;
+
+    if (self->names_cap - self->names_len < len)
+    {
+        size_t newcap = (self->names_cap + len) * 2;
+        char *grown = realloc(self->names, newcap);
+        if (NULL == grown)
+        {
+            perror("failed to queue file");
+            return;
+        }
+        self->names = grown;
+        self->names_cap = newcap;
+    }
+    memcpy(self->names + self->names_len, name, len);
+    self->names_len += len;
+    if (FILES_PER_WORK == ++self->nnames)
+    {
+        flush_names(self, dir, dirlen);
+    }
+}
+
+/**
+ * Read the entries of @param dir, queueing subdirectories and full batches
+ * of files, then search the remaining partial batch while the directory is
+ * still open.
+ */
+static void walk_dir(struct worker *self, const char *dir)
+{
+    char dents[DENTS_BUF_SIZE];
+    size_t dirlen = strlen(dir);
+    char *path;
+    ssize_t n;
+    int fd;
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (-1 == fd)
+    {
+        fprintf(stderr, "finder: %s: %s\n", dir, strerror(errno));
+        return;
+    }
+
+    while (0 < (n = getdents64(fd, dents, sizeof(dents))))
+    {
+        for (ssize_t off = 0; off < n;)
+        {
+            struct dirent64 *ent = (struct dirent64 *)(void *)(dents + off);
+            unsigned char type = ent->d_type;
+            struct stat st;
+
+            off += ent->d_reclen;
+            if ((0 == strcmp(ent->d_name, ".")) || (0 == strcmp(ent->d_name, "..")))
+            {
+                continue;
+            }
+            if ((DT_UNKNOWN == type) && (0 == fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW)))
+            {
+                type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+            }
+
+            // Symlinks are neither followed nor counted, as with find -type f
+            // and grep -r
+            if (DT_DIR == type)
+            {
+                if (-1 != asprintf(&path, "%s/%s", dir, ent->d_name))
+                {
+                    work_push(self, WORK_DIR, path, strlen(path), NULL, 0, 0);
+                    free(path);
+                }
+            }
+            else if (DT_REG == type)
+            {
+                add_name(self, dir, dirlen, ent->d_name);
+            }
+        }
+    }
+    if (-1 == n)
+    {
+        fprintf(stderr, "finder: %s: %s\n", dir, strerror(errno));
+    }
+
+    for (const char *name = self->names; self->nnames > 0; self->nnames--)
+    {
+        search_file(self, fd, dir, name);
+        name += strlen(name) + 1;
+    }
+    self->names_len = 0;
+    close(fd);
+}
+
+static void search_files(struct worker *self, struct work *work)
+{
+    const char *dir = work->data;
+    const char *name = dir + strlen(dir) + 1;
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (-1 == fd)
+    {
+        fprintf(stderr, "finder: %s: %s\n", dir, strerror(errno));
+        return;
+    }
+    for (size_t i = 0; i < work->nnames; i++)
+    {
+        search_file(self, fd, dir, name);
+        name += strlen(name) + 1;
+    }
+    close(fd);
+}
+
+static void *worker_thread(void *self_param)
+{
+    struct worker *self = (struct worker *)self_param;
+    struct work *work;
+
+    while (true)
+    {
+        work = work_take(self);
+        if (NULL != work)
+        {
+            if (WORK_DIR == work->kind)
+            {
+                walk_dir(self, work->data);
+            }
+            else
+            {
+                search_files(self, work);
+            }
+            free(work);
+
+            if (1 == atomic_fetch_sub(&pending, 1))
+            {
+                pthread_mutex_lock(&idle_lock);
+                pthread_cond_broadcast(&idle_cond);
+                pthread_mutex_unlock(&idle_lock);
+            }
+            continue;
+        }
+
+        // Nothing to steal, sleep until more is queued or the walk is done
+        pthread_mutex_lock(&idle_lock);
+        atomic_fetch_add(&nidle, 1);
+        while ((0 == atomic_load(&queued)) && (0 != atomic_load(&pending)))
+        {
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        }
+        atomic_fetch_sub(&nidle, 1);
+        pthread_mutex_unlock(&idle_lock);
+        if (0 == atomic_load(&pending))
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longopts[] = {
+        {"help", no_argument, 0, 'h'},
+        {"jobs", required_argument, 0, 'j'},
+        {0, 0, 0, 0},
+    };
+    static const char *optstring = "hj:";
+    const char *filesdir;
+    struct stat st;
+    size_t files = 0;
+    size_t lines = 0;
+    long jobs = 0;
+    int opt;
+    int rc;
+
+    while (-1 != (opt = getopt_long(argc, argv, optstring, longopts, 0)))
+    {
+        switch (opt)
+        {
+        case 'h':
+            print_help();
+            exit(EXIT_SUCCESS);
+        case 'j':
+            jobs = atol(optarg);
+            break;
+        case ':':
+            fprintf(stderr, "Option '%c' requires an argument\n", (char)optopt);
+            __attribute__((fallthrough));
+        default:
+            print_help();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    filesdir = (optind < argc) ? argv[optind] : "";
+    searchstr = (optind + 1 < argc) ? argv[optind + 1] : "";
+    searchlen = strlen(searchstr);
+    if ((0 == strlen(filesdir)) || (0 != stat(filesdir, &st)) || !S_ISDIR(st.st_mode))
+    {
+        fprintf(stderr, "Specified files dir '%s' empty or does not exist\n", filesdir);
+        exit(EXIT_FAILURE);
+    }
+    if (0 == searchlen)
+    {
+        fprintf(stderr, "Search string not specified\n");
+        exit(EXIT_FAILURE);
+    }
+    use_regex = (NULL != strpbrk(searchstr, BRE_SPECIAL));
+
+    if (jobs <= 0)
+    {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    nworkers = (jobs > 0) ? (size_t)jobs : 1;
+    workers = calloc(nworkers, sizeof(struct worker));
+    if (NULL == workers)
+    {
+        perror("failed to allocate workers");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < nworkers; i++)
+    {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        TAILQ_INIT(&workers[i].queue);
+        workers[i].bufsize = READ_MAX_SIZE;
+        workers[i].buf = malloc(workers[i].bufsize);
+        if (NULL == workers[i].buf)
+        {
+            perror("failed to allocate read buffer");
+            exit(EXIT_FAILURE);
+        }
+        if (use_regex && (0 != (rc = regcomp(&workers[i].regex, searchstr, REG_NOSUB))))
+        {
+            char err[256];
+            regerror(rc, &workers[i].regex, err, sizeof(err));
+            fprintf(stderr, "finder: invalid pattern '%s': %s\n", searchstr, err);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Seed the first worker; the rest start out stealing
+    work_push(&workers[0], WORK_DIR, filesdir, strlen(filesdir), NULL, 0, 0);
+    for (size_t i = 0; i < nworkers; i++)
+    {
+        if (0 != pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]))
+        {
+            perror("failed to start worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t i = 0; i < nworkers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        files += workers[i].files;
+        lines += workers[i].lines;
+        if (use_regex)
+        {
+            regfree(&workers[i].regex);
+        }
+        free(workers[i].buf);
+        free(workers[i].names);
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+    free(workers);
+
+    printf("The number of files are %zu and the number of matching lines are %zu\n", files, lines);
+    return EXIT_SUCCESS;
+}
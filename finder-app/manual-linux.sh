@@ -66,9 +66,9 @@ echo "Creating dev nodes"
 sudo mknod -m 666 "${OUTDIR:?}/rootfs/dev/null" c 1 3
 sudo mknod -m 620 "${OUTDIR:?}/rootfs/dev/console" c 5 1
 
-# Clean and build the writer utility
+# Clean and build the writer and finder utilities
 pushd "${FINDER_APP_DIR}" &>/dev/null
-echo "Building & installing writer util"
+echo "Building & installing writer and finder utils"
 make CROSS_COMPILE="${CROSS_COMPILE}" clean
 make -j "$(nproc --all)" CROSS_COMPILE="${CROSS_COMPILE}"
 # Copy the finder related scripts and executables to the /home directory
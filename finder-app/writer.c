@@ -2,19 +2,492 @@
  * ianmclinden, 2024
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define LOG_IDENT "writer"
 
+/**
+ * Records a batch worker claims at a time
+ */
+#define RECORDS_PER_CLAIM 64
+/**
+ * Filesystems a batch worker tracks to syncfs() at the end, beyond this it
+ * falls back to sync()
+ */
+#define MAX_SYNC_FS 8
+#define MANIFEST_READ_SIZE (1024 * 1024)
+
+struct record
+{
+    const char *path;
+    const char *content;
+    size_t len;
+};
+
+struct batch
+{
+    struct record *records;
+    size_t nrecords;
+    atomic_size_t next;
+    atomic_size_t failed;
+    atomic_bool sync_all;
+};
+
+struct batch_worker
+{
+    pthread_t thread;
+    struct batch *batch;
+    /**
+     * One open file per filesystem written to, to syncfs() at the end
+     */
+    int sync_fds[MAX_SYNC_FS];
+    dev_t sync_devs[MAX_SYNC_FS];
+    size_t nsync;
+};
+
+void print_help()
+{
+    printf("writer - write a string to a file\n");
+    printf("\n");
+    printf("Usage: writer <FILE> <STRING>\n");
+    printf("       writer --batch [options] [MANIFEST]\n");
+    printf("\n");
+    printf("Options:\n");
+    printf(" --help,-h              Print this help and exit\n");
+    printf(" --batch, -B            Write every record of MANIFEST (Default: stdin),\n");
+    printf("                        one FILE<TAB>STRING per line. STRING may use \\n,\n");
+    printf("                        \\t and \\\\ escapes. Data is synced once at the end\n");
+    printf(" --null, -0             Manifest records are FILE<NUL>STRING<NUL>, unescaped\n");
+    printf(" --jobs, -j <N>         Write with N threads. (Default: 1)\n");
+}
+
+/**
+ * Read all of @param fd, mapping it if it is a regular file.
+ * @return the contents, or NULL on error. @param len is set to their length
+ * and @param mapped to whether they must be released with munmap() rather
+ * than free(), see release_manifest().
+ */
+static char *read_manifest(int fd, size_t *len, bool *mapped)
+{
+    struct stat st;
+    char *buf = NULL;
+    size_t cap = 0;
+    ssize_t n;
+
+    *len = 0;
+    *mapped = false;
+    if ((0 == fstat(fd, &st)) && S_ISREG(st.st_mode) && (0 < st.st_size))
+    {
+        // Private and writable, records are split in place
+        buf = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (MAP_FAILED != buf)
+        {
+            *len = (size_t)st.st_size;
+            *mapped = true;
+            return buf;
+        }
+        buf = NULL;
+    }
+
+    while (true)
+    {
+        if (cap - *len < MANIFEST_READ_SIZE)
+        {
+            char *grown = realloc(buf, cap + MANIFEST_READ_SIZE);
+            if (NULL == grown)
+            {
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+            cap += MANIFEST_READ_SIZE;
+        }
+        n = read(fd, buf + *len, cap - *len);
+        if (0 < n)
+        {
+            *len += (size_t)n;
+        }
+        else if (0 == n)
+        {
+            return buf;
+        }
+        else if (EINTR != errno)
+        {
+            free(buf);
+            return NULL;
+        }
+    }
+}
+
+static void release_manifest(char *buf, size_t len, bool mapped)
+{
+    if (mapped)
+    {
+        munmap(buf, len);
+    }
+    else
+    {
+        free(buf);
+    }
+}
+
+/**
+ * Undo \n, \t and \\ escapes in the @param len bytes at @param str in place.
+ * @return the unescaped length.
+ */
+static size_t unescape(char *str, size_t len)
+{
+    size_t out = 0;
+
+    for (size_t in = 0; in < len; in++)
+    {
+        if (('\\' == str[in]) && (in + 1 < len))
+        {
+            switch (str[in + 1])
+            {
+            case 'n':
+                str[out++] = '\n';
+                in++;
+                continue;
+            case 't':
+                str[out++] = '\t';
+                in++;
+                continue;
+            case '\\':
+                str[out++] = '\\';
+                in++;
+                continue;
+            default:
+                break;
+            }
+        }
+        str[out++] = str[in];
+    }
+    return out;
+}
+
+/**
+ * Split the @param len byte manifest at @param buf into @param records, in
+ * place. @param nrecords is set to their count.
+ * @return false if the manifest is malformed or memory ran out.
+ */
+static bool parse_manifest(char *buf, size_t len, bool null_sep, struct record **records, size_t *nrecords)
+{
+    struct record *grown;
+    size_t cap = 0;
+    char *end = buf + len;
+    char *p = buf;
+    char *sep;
+    char *eol;
+
+    *records = NULL;
+    *nrecords = 0;
+    while (p < end)
+    {
+        if (null_sep)
+        {
+            sep = memchr(p, '\0', (size_t)(end - p));
+            eol = (NULL == sep) ? NULL : memchr(sep + 1, '\0', (size_t)(end - sep - 1));
+        }
+        else
+        {
+            eol = memchr(p, '\n', (size_t)(end - p));
+            if (eol == p)
+            {
+                p++; // Blank line
+                continue;
+            }
+            sep = memchr(p, '\t', (size_t)(((NULL != eol) ? eol : end) - p));
+        }
+        if (NULL == sep)
+        {
+            syslog(LOG_ERR, "Manifest record %zu has no string", *nrecords + 1);
+            free(*records);
+            return false;
+        }
+        if (NULL == eol)
+        {
+            eol = end; // Unterminated last record
+        }
+
+        if (*nrecords == cap)
+        {
+            cap = (0 == cap) ? 1024 : cap * 2;
+            grown = realloc(*records, cap * sizeof(struct record));
+            if (NULL == grown)
+            {
+                syslog(LOG_ERR, "Could not allocate %zu records", cap);
+                free(*records);
+                return false;
+            }
+            *records = grown;
+        }
+        *sep = '\0';
+        (*records)[*nrecords].path = p;
+        (*records)[*nrecords].content = sep + 1;
+        (*records)[*nrecords].len = null_sep ? (size_t)(eol - sep - 1) : unescape(sep + 1, (size_t)(eol - sep - 1));
+        (*nrecords)++;
+        p = eol + 1;
+    }
+    return true;
+}
+
+/**
+ * Remember @param fd if it is the first seen on its filesystem.
+ * @return true if @param fd was kept and must not be closed.
+ */
+static bool track_fs(struct batch_worker *self, int fd)
+{
+    struct stat st;
+
+    if (self->batch->sync_all || (0 != fstat(fd, &st)))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < self->nsync; i++)
+    {
+        if (self->sync_devs[i] == st.st_dev)
+        {
+            return false;
+        }
+    }
+    if (MAX_SYNC_FS == self->nsync)
+    {
+        self->batch->sync_all = true;
+        return false;
+    }
+    self->sync_devs[self->nsync] = st.st_dev;
+    self->sync_fds[self->nsync++] = fd;
+    return true;
+}
+
+static bool write_record(struct batch_worker *self, const struct record *rec)
+{
+    size_t off = 0;
+    ssize_t n;
+    int fd;
+
+    fd = open(rec->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (-1 == fd)
+    {
+        syslog(LOG_ERR, "Could not open file '%s' for writing", rec->path);
+        return false;
+    }
+
+    // Straight from the manifest, no stdio copy
+    while (off < rec->len)
+    {
+        n = write(fd, rec->content + off, rec->len - off);
+        if (0 < n)
+        {
+            off += (size_t)n;
+        }
+        else if ((-1 == n) && (EINTR != errno))
+        {
+            break;
+        }
+    }
+    if (off != rec->len)
+    {
+        syslog(LOG_ERR, "Only wrote %zu of %zu bytes to %s", off, rec->len, rec->path);
+    }
+
+    if (!track_fs(self, fd))
+    {
+        close(fd);
+    }
+    return off == rec->len;
+}
+
+static void *batch_thread(void *self_param)
+{
+    struct batch_worker *self = (struct batch_worker *)self_param;
+    struct batch *batch = self->batch;
+    size_t start;
+    size_t end;
+
+    while ((start = atomic_fetch_add(&batch->next, RECORDS_PER_CLAIM)) < batch->nrecords)
+    {
+        end = (start + RECORDS_PER_CLAIM < batch->nrecords) ? start + RECORDS_PER_CLAIM : batch->nrecords;
+        for (size_t i = start; i < end; i++)
+        {
+            if (!write_record(self, &batch->records[i]))
+            {
+                atomic_fetch_add(&batch->failed, 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Write every record of the manifest at @param manifest ("-" for stdin) with
+ * @param jobs threads, then flush the filesystems written to once.
+ */
+static int run_batch(const char *manifest, bool null_sep, size_t jobs)
+{
+    struct batch batch = {0};
+    struct batch_worker *workers;
+    size_t len;
+    char *buf;
+    bool mapped;
+    int fd = STDIN_FILENO;
+    int rc = EXIT_SUCCESS;
+
+    if ((NULL != manifest) && (0 != strcmp(manifest, "-")) &&
+        (-1 == (fd = open(manifest, O_RDONLY | O_CLOEXEC))))
+    {
+        syslog(LOG_ERR, "Could not open manifest '%s'", manifest);
+        return EXIT_FAILURE;
+    }
+    buf = read_manifest(fd, &len, &mapped);
+    if (STDIN_FILENO != fd)
+    {
+        close(fd);
+    }
+    if (NULL == buf)
+    {
+        syslog(LOG_ERR, "Could not read manifest");
+        return EXIT_FAILURE;
+    }
+    if (!parse_manifest(buf, len, null_sep, &batch.records, &batch.nrecords))
+    {
+        release_manifest(buf, len, mapped);
+        return EXIT_FAILURE;
+    }
+
+    if (jobs > batch.nrecords)
+    {
+        jobs = (0 < batch.nrecords) ? batch.nrecords : 1;
+    }
+    workers = calloc(jobs, sizeof(struct batch_worker));
+    if (NULL == workers)
+    {
+        syslog(LOG_ERR, "Could not allocate %zu workers", jobs);
+        free(batch.records);
+        release_manifest(buf, len, mapped);
+        return EXIT_FAILURE;
+    }
+
+    // Worker 0 is this thread
+    for (size_t i = 0; i < jobs; i++)
+    {
+        workers[i].batch = &batch;
+        if ((0 != i) && (0 != pthread_create(&workers[i].thread, NULL, batch_thread, &workers[i])))
+        {
+            syslog(LOG_ERR, "Could not start worker %zu", i);
+            jobs = i;
+            break;
+        }
+    }
+    batch_thread(&workers[0]);
+    for (size_t i = 1; i < jobs; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    if (batch.sync_all)
+    {
+        sync();
+    }
+    for (size_t i = 0; i < jobs; i++)
+    {
+        for (size_t j = 0; j < workers[i].nsync; j++)
+        {
+            if (!batch.sync_all && (0 != syncfs(workers[i].sync_fds[j])))
+            {
+                syslog(LOG_ERR, "Could not sync written files");
+                rc = EXIT_FAILURE;
+            }
+            close(workers[i].sync_fds[j]);
+        }
+    }
+
+    syslog(LOG_DEBUG, "Wrote %zu of %zu files", batch.nrecords - batch.failed, batch.nrecords);
+    if (0 != batch.failed)
+    {
+        rc = EXIT_FAILURE;
+    }
+    free(workers);
+    free(batch.records);
+    release_manifest(buf, len, mapped);
+    return rc;
+}
+
 int main(int argc, char **argv)
 {
+    static const struct option longopts[] = {
+        {"help", no_argument, 0, 'h'},
+        {"batch", no_argument, 0, 'B'},
+        {"null", no_argument, 0, '0'},
+        {"jobs", required_argument, 0, 'j'},
+        {0, 0, 0, 0},
+    };
+    static const char *optstring = "+hB0j:";
+    bool batch = false;
+    bool null_sep = false;
+    long jobs = 1;
+    int opt;
+
     // let's be lazy and let exit close the file / closelog (incl error cases)
     openlog(LOG_IDENT, 0, LOG_USER);
 
-    if (argc <= 2)
+    // A lone --help would be a write missing its STRING, so it's free to take
+    if ((2 == argc) && ((0 == strcmp(argv[1], "--help")) || (0 == strcmp(argv[1], "-h"))))
+    {
+        print_help();
+        exit(EXIT_SUCCESS);
+    }
+
+    // Options only follow --batch, anything else is a plain FILE STRING write
+    // even if FILE looks like an option
+    if ((2 <= argc) && ((0 == strcmp(argv[1], "--batch")) || (0 == strcmp(argv[1], "-B"))))
+    {
+        while (-1 != (opt = getopt_long(argc, argv, optstring, longopts, 0)))
+        {
+            switch (opt)
+            {
+            case 'h':
+                print_help();
+                exit(EXIT_SUCCESS);
+            case 'B':
+                batch = true;
+                break;
+            case '0':
+                null_sep = true;
+                break;
+            case 'j':
+                jobs = atol(optarg);
+                break;
+            case ':':
+                fprintf(stderr, "Option '%c' requires an argument\n", (char)optopt);
+                __attribute__((fallthrough));
+            default:
+                print_help();
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (batch)
+    {
+        return run_batch((optind < argc) ? argv[optind] : NULL, null_sep, (jobs > 0) ? (size_t)jobs : 1);
+    }
+
+    if (argc < 3)
     {
         syslog(LOG_ERR, "Write file or write string not specified");
         return EXIT_FAILURE;
@@ -22,7 +495,7 @@ int main(int argc, char **argv)
 
     const char *filename = argv[1];
     const char *writestr = argv[2];
-    FILE *wptr = fopen(argv[1], "w");
+    FILE *wptr = fopen(filename, "w");
     if (NULL == wptr)
     {
         syslog(LOG_ERR, "Could not open file '%s' for writing", filename);
@@ -40,4 +513,4 @@ int main(int argc, char **argv)
     }
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
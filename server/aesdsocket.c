@@ -18,9 +18,15 @@
 #include <syslog.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/queue.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "replication.h"
+#include "store.h"
+#include "streams.h"
+
 #ifdef DEBUG
 #define syslog(b, ...)       \
     {                        \
@@ -36,14 +42,32 @@ const char DEFAULT_LOGFILE_PATH[] = "/var/tmp/aesdsocketdata";
 const int SVR_BACKLOG = 16;
 const size_t BUF_BLKSZ = 4096;
 const long int LOG_IVAL_SEC = 10;
+const size_t DEFAULT_RING_BYTES = 1024 * 1024;
+const int FOLLOW_POLL_MS = 1000;
+const size_t STATUS_BUF_SIZE = 4096;
+
+// Command lines, handled instead of being committed
+const char CMD_SUBSCRIBE[] = "AESDSOCKET_SUBSCRIBE:";
+const char CMD_STREAM[] = "AESDSOCKET_STREAM:";
+const char CMD_ENCODING[] = "AESDSOCKET_ENCODING:";
+const char CMD_SNAPSHOT[] = "AESDSOCKET_SNAPSHOT:";
+const char CMD_READ[] = "AESDSOCKET_READ:";
+const char CMD_STATUS[] = "AESDSOCKET_STATUS:";
 
 const struct option longopts[] = {
     {"help", no_argument, NULL, 'h'},
     {"daemonize", no_argument, NULL, 'd'},
     {"port", required_argument, NULL, 'p'},
     {"logfile", required_argument, NULL, 'f'},
+    {"store", required_argument, NULL, 's'},
+    {"ring-entries", required_argument, NULL, 'n'},
+    {"ring-bytes", required_argument, NULL, 'b'},
+    {"shards", required_argument, NULL, 'S'},
+    {"unix", required_argument, NULL, 'u'},
+    {"replicate-port", required_argument, NULL, 'r'},
+    {"follow", required_argument, NULL, 'F'},
     {NULL, 0, NULL, 0}};
-const char *optstring = "hdp:f:";
+const char *optstring = "hdp:f:s:n:b:S:u:r:F:";
 
 void print_help()
 {
@@ -56,17 +80,67 @@ void print_help()
     printf(" --daemonize, -d        Run the server as a daemon\n");
     printf(" --port, -p <PORT>      Bind to port PORT. (Default: %d)\n", DEFAULT_PORT);
     printf(" --logfile, -f <FILE>   Log output to FILE. (Default '%s')\n", DEFAULT_LOGFILE_PATH);
+    printf(" --store, -s <STORE>    Keep committed lines in STORE, either 'file' (FILE\n");
+    printf("                        on disk) or 'ring' (memory only). (Default 'file')\n");
+    printf(" --ring-entries, -n <N> Lines kept by the ring store. (Default: %d)\n",
+           STORE_RING_MAX_ENTRIES);
+    printf(" --ring-bytes, -b <N>   Bytes kept by the ring store. (Default: %zu)\n", DEFAULT_RING_BYTES);
+    printf(" --shards, -S <N>       Spread named streams over N locks. (Default: CPUs)\n");
+    printf(" --unix, -u <PATH>      Also listen on a unix domain socket at PATH, use an\n");
+    printf("                        absolute path with --daemonize\n");
+    printf(" --replicate-port, -r <PORT>\n");
+    printf("                        Lead: stream the log to followers connecting to\n");
+    printf("                        PORT\n");
+    printf(" --follow, -F <HOST:PORT>\n");
+    printf("                        Follow the leader replicating on HOST:PORT, serving\n");
+    printf("                        a read-only copy of its log\n");
+    printf("\n");
+    printf("Commands:\n");
+    printf(" %s<OFFSET>\n", CMD_SUBSCRIBE);
+    printf("                        Instead of committing a line, send the log from\n");
+    printf("                        byte OFFSET and keep the connection open, pushing\n");
+    printf("                        new lines as they are committed\n");
+    printf(" %s<NAME>\n", CMD_STREAM);
+    printf("                        As the first line of a connection, use stream NAME\n");
+    printf("                        instead of the default one. A single line can also\n");
+    printf("                        be sent to a stream by prefixing it with '@NAME '.\n");
+    printf("                        Lines that start with '@' are escaped as '@@'.\n");
+    printf("                        Named streams log to FILE.NAME\n");
+    printf(" %s<ENCODING>\n", CMD_ENCODING);
+    printf("                        As a first line of a connection, send replies as\n");
+    printf("                        'identity' (default) or 'gzip', concatenated gzip\n");
+    printf("                        members. An unsupported ENCODING closes the\n");
+    printf("                        connection. Can be combined with %s\n", CMD_STREAM);
+    printf(" %s<OFFSET>\n", CMD_SNAPSHOT);
+    printf("                        Unix socket only. Instead of committing a line,\n");
+    printf("                        reply with the log size from byte OFFSET and pass\n");
+    printf("                        a sealed memfd holding that data (SCM_RIGHTS)\n");
+    printf(" %s<OFFSET>\n", CMD_READ);
+    printf("                        Instead of committing a line, send the log from\n");
+    printf("                        byte OFFSET and close. Works on followers too\n");
+    printf(" %s\n", CMD_STATUS);
+    printf("                        Reply with the log size and replication state,\n");
+    printf("                        including follower lag in bytes and ms\n");
 }
 
 // Being lazy and just allocating some globals
 bool daemonize = false;
 uint16_t port = DEFAULT_PORT;
-const char *logfile_path = DEFAULT_LOGFILE_PATH;
+struct store_config store_config = {
+    .kind = STORE_FILE,
+    .path = DEFAULT_LOGFILE_PATH,
+    .ring_entries = STORE_RING_MAX_ENTRIES,
+    .ring_bytes = DEFAULT_RING_BYTES,
+};
+size_t nshards = 0;
+const char *unix_path = NULL;
+uint16_t replicate_port = 0;
+const char *follow_leader = NULL;
 
 // Non-atomic run flag -  we only have 1 living process accessing this
 volatile bool running = true;
-pthread_mutex_t logfile_mutex;
-int logfile = -1;
+struct streams *streams = NULL;
+struct replication *replication = NULL;
 
 static void handle_signals(int signo)
 {
@@ -81,7 +155,6 @@ void handle_log(__attribute__((unused)) union sigval val)
 {
     time_t now;
     struct tm *now_tm;
-    size_t expected, wrote = 0;
     char buf[255] = {0};
 
     now = time(NULL);
@@ -98,30 +171,125 @@ void handle_log(__attribute__((unused)) union sigval val)
         exit(errno);
     }
 
-    if (0 != pthread_mutex_lock(&logfile_mutex))
+    if (0 != store_append(streams_default(streams), buf, strlen(buf)))
+    {
+        syslog(LOG_ERR, "failed to commit timestamp");
+    }
+}
+
+// Stream the log to a subscriber from offset, then push new data as it is
+// published until the client hangs up or we shut down. Only this client's
+// socket is ever blocked on, so a slow subscriber can't hold up writers. Sends
+// time out every FOLLOW_POLL_MS so one that stopped reading can't hold up
+// shutdown either.
+static void follow_client(struct store *store, int sock, size_t offset, const char *cli_addr_str)
+{
+    struct pollfd cli_pfd = {.fd = sock, .events = POLLIN};
+    struct timeval tv = {
+        .tv_sec = FOLLOW_POLL_MS / 1000,
+        .tv_usec = (FOLLOW_POLL_MS % 1000) * 1000,
+    };
+    char discard[256];
+    ssize_t sent;
+
+    syslog(LOG_DEBUG, "Following log for %s from offset %zu", cli_addr_str, offset);
+
+    if (-1 == setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)))
     {
-        syslog(LOG_ERR, "failed to acquire logfile lock");
+        syslog(LOG_ERR, "failed to set send timeout for %s", cli_addr_str);
         return;
     }
 
-    expected = strlen(buf);
-    wrote = (size_t)write(logfile, buf, expected);
-    if (expected != wrote)
+    while (running)
     {
-        syslog(LOG_ERR, "only wrote %ld of %ld bytes", wrote, expected);
+        size_t from = offset;
+        if (0 > (sent = store_send(store, sock, &offset)))
+        {
+            if (EAGAIN == errno)
+            {
+                continue; // Stalled client, offset holds what did make it
+            }
+            break; // Client gone
+        }
+        if (offset - (size_t)sent > from)
+        {
+            syslog(LOG_WARNING, "%s fell behind, skipped %zu evicted bytes",
+                   cli_addr_str, offset - (size_t)sent - from);
+        }
+
+        if (-1 == store_wait(store, offset, FOLLOW_POLL_MS))
+        {
+            break; // Shutting down
+        }
+
+        // Subscribers have nothing more to say, anything readable is a hangup
+        if (0 < poll(&cli_pfd, 1, 0) && (0 >= read(sock, discard, sizeof(discard))))
+        {
+            break;
+        }
     }
+}
 
-    if (0 != pthread_mutex_unlock(&logfile_mutex))
+// Hand a local client a read-only snapshot of the log instead of the bytes,
+// the payload is the snapshot size so the client knows what to mmap
+static void send_snapshot(struct store *store, int sock, size_t offset, const char *cli_addr_str)
+{
+    char payload[32];
+    char cbuf[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {.iov_base = payload};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = sizeof(cbuf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    size_t size = 0;
+    int fd;
+
+    if (-1 == (fd = store_snapshot(store, offset, &size)))
     {
-        syslog(LOG_ERR, "failed to release logfile lock");
         return;
     }
+
+    iov.iov_len = (size_t)snprintf(payload, sizeof(payload), "%zu\n", size);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (-1 == sendmsg(sock, &msg, 0))
+    {
+        syslog(LOG_ERR, "failed to pass snapshot to %s", cli_addr_str);
+    }
+    close(fd); // The client holds its own reference now
+}
+
+// Replication state is only tracked for the default stream, named streams
+// just report their size
+static void send_status(struct store *store, int sock, const char *cli_addr_str)
+{
+    char buf[STATUS_BUF_SIZE];
+    int len;
+
+    if (store == streams_default(streams))
+    {
+        len = replication_status(replication, store, buf, sizeof(buf));
+    }
+    else
+    {
+        len = replication_status(NULL, store, buf, sizeof(buf));
+    }
+    if ((0 < len) && (0 != store_write_all(sock, buf, ((size_t)len < sizeof(buf)) ? (size_t)len : sizeof(buf) - 1)))
+    {
+        syslog(LOG_ERR, "failed to send status to %s", cli_addr_str);
+    }
 }
 
 struct cli_data
 {
     int sock;
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t addr_len;
     char *buf;
 };
@@ -132,14 +300,20 @@ void *handle_client(void *params)
 
     struct pollfd cli_pfd = {.fd = data->sock, .events = POLLIN};
     char cli_addr_str[INET_ADDRSTRLEN] = {0};
-    size_t expected, wrote = 0;
+    size_t reply_offset = 0;
+    struct store *conn_store = streams_default(streams);
+    enum store_encoding conn_encoding = STORE_ENCODING_IDENTITY;
     char *buf_wptr = data->buf;
     long unsigned int buf_size = (long unsigned int)BUF_BLKSZ;
     ssize_t rd = 0;
 
     cli_pfd.fd = data->sock;
 
-    if (NULL == inet_ntop(AF_INET, &data->addr.sin_addr, cli_addr_str, sizeof(cli_addr_str)))
+    if (AF_UNIX == data->addr.ss_family)
+    {
+        strncpy(cli_addr_str, "local", sizeof(cli_addr_str) - 1); // Peers are rarely bound
+    }
+    else if (NULL == inet_ntop(AF_INET, &((struct sockaddr_in *)&data->addr)->sin_addr, cli_addr_str, sizeof(cli_addr_str)))
     {
         syslog(LOG_ERR, "unable to parse client address");
         close(data->sock);
@@ -195,55 +369,121 @@ void *handle_client(void *params)
         // only need to check from the last written ptr
         if (((size_t)(buf_wptr - data->buf) > 0) && ('\n' == *(buf_wptr - 1)))
         {
-            if (0 != pthread_mutex_lock(&logfile_mutex))
+            char *line = data->buf;
+            struct store *target;
+
+            // Connection headers, select the stream and encoding for
+            // everything after them
+            while ((0 == strncmp(line, CMD_STREAM, strlen(CMD_STREAM))) ||
+                   (0 == strncmp(line, CMD_ENCODING, strlen(CMD_ENCODING))))
+            {
+                char *name = strchr(line, ':') + 1;
+                char *eol = strchr(name, '\n'); // Can't miss, buffer ends in one
+                size_t used = (size_t)(buf_wptr - data->buf);
+                size_t rest = (size_t)(buf_wptr - (eol + 1));
+
+                if (0 == strncmp(line, CMD_STREAM, strlen(CMD_STREAM)))
+                {
+                    if (!stream_name_valid(name, (size_t)(eol - name)) ||
+                        (NULL == (conn_store = streams_get(streams, name, (size_t)(eol - name)))))
+                    {
+                        syslog(LOG_ERR, "%s selected an unusable stream", cli_addr_str);
+                        conn_store = NULL;
+                        break;
+                    }
+                }
+                else if (0 != store_parse_encoding(name, (size_t)(eol - name), &conn_encoding))
+                {
+                    syslog(LOG_ERR, "%s selected an unsupported encoding", cli_addr_str);
+                    conn_store = NULL;
+                    break;
+                }
+                memmove(data->buf, eol + 1, rest);
+                memset(data->buf + rest, 0, used - rest);
+                buf_wptr = data->buf + rest;
+            }
+            if (NULL == conn_store)
             {
-                syslog(LOG_ERR, "failed to acquire logfile lock");
                 break;
             }
+            if (buf_wptr == data->buf)
+            {
+                continue; // Headers only, wait for the line they apply to
+            }
+            target = conn_store;
 
-            // Actually had a full line, let's log it and send the logfile back to the client
-            expected = strlen(data->buf);
-            wrote = (size_t)write(logfile, data->buf, expected);
-            if (expected != wrote)
+            // "@name line" routes just this line, "@@line" commits "@line"
+            if (('@' == line[0]) && ('@' == line[1]))
             {
-                // Not gonna handle this case
-                syslog(LOG_ERR, "only wrote %ld of %ld bytes", wrote, expected);
+                line++;
+            }
+            else if ('@' == line[0])
+            {
+                char *space = strchr(line, ' ');
+                if ((NULL != space) && stream_name_valid(line + 1, (size_t)(space - line - 1)))
+                {
+                    if (NULL == (target = streams_get(streams, line + 1, (size_t)(space - line - 1))))
+                    {
+                        syslog(LOG_ERR, "failed to open stream for %s", cli_addr_str);
+                        break;
+                    }
+                    line = space + 1;
+                }
             }
 
-            // Send return file contents
-            if (-1 == lseek(logfile, SEEK_SET, 0))
+            if (0 == strncmp(line, CMD_SUBSCRIBE, strlen(CMD_SUBSCRIBE)))
             {
-                syslog(LOG_ERR, "failed to seek to beginning of logfile");
+                reply_offset = (size_t)strtoull(line + strlen(CMD_SUBSCRIBE), NULL, 10);
+                follow_client(target, data->sock, reply_offset, cli_addr_str);
                 break;
             }
-            while (running)
-            {
-                // Reusing the the first block of the buffer
-                memset(data->buf, 0, BUF_BLKSZ);
 
-                // Read & send BUF_BLKSZ at a time, let the kernel fragment as necessary
-                if (0 > (rd = read(logfile, data->buf, BUF_BLKSZ)))
+            if (0 == strncmp(line, CMD_READ, strlen(CMD_READ)))
+            {
+                reply_offset = (size_t)strtoull(line + strlen(CMD_READ), NULL, 10);
+                if (0 > store_send_encoded(target, data->sock, &reply_offset, conn_encoding))
                 {
-                    break; // Err only
+                    syslog(LOG_ERR, "only sent back %zu bytes", reply_offset);
                 }
-                expected = (size_t)rd;
-                wrote = (size_t)write(data->sock, data->buf, expected);
-                if (expected != wrote)
+                break;
+            }
+
+            if (0 == strncmp(line, CMD_STATUS, strlen(CMD_STATUS)))
+            {
+                send_status(target, data->sock, cli_addr_str);
+                break;
+            }
+
+            if (0 == strncmp(line, CMD_SNAPSHOT, strlen(CMD_SNAPSHOT)))
+            {
+                if (AF_UNIX != data->addr.ss_family)
                 {
-                    // Not gonna handle this case
-                    syslog(LOG_ERR, "only sent back %ld of %ld bytes", wrote, expected);
+                    syslog(LOG_ERR, "%s requested a snapshot over a non-local socket", cli_addr_str);
                     break;
                 }
-                if (0 == rd)
-                {
-                    break; // EOF
-                }
+                reply_offset = (size_t)strtoull(line + strlen(CMD_SNAPSHOT), NULL, 10);
+                send_snapshot(target, data->sock, reply_offset, cli_addr_str);
+                break;
+            }
+
+            // Followers only ever take lines from their leader
+            if (replication_is_follower(replication))
+            {
+                syslog(LOG_WARNING, "refusing write from %s, this is a read-only follower", cli_addr_str);
+                break;
             }
-            if (0 != pthread_mutex_unlock(&logfile_mutex))
+
+            // Actually had a full line, let's commit it and send the log back to the client
+            if (0 != store_append(target, line, strlen(line)))
             {
-                syslog(LOG_ERR, "failed to release logfile lock");
+                syslog(LOG_ERR, "failed to commit client line");
                 break;
             }
+            if (0 > store_send_encoded(target, data->sock, &reply_offset, conn_encoding))
+            {
+                // Not gonna handle this case
+                syslog(LOG_ERR, "only sent back %zu bytes", reply_offset);
+            }
             break; // Only one line handled per client, done now
         }
     }
@@ -286,9 +526,13 @@ int main(int argc, char **argv)
         .sigev_notify_attributes = NULL,
     };
     struct sigaction sa = {.sa_handler = handle_signals, .sa_flags = SA_RESTART};
+    struct sigaction sa_ign = {.sa_handler = SIG_IGN};
     struct sockaddr_in bind_addr;
+    struct sockaddr_un unix_addr = {.sun_family = AF_UNIX};
     int svr_sock = -1;
-    struct pollfd svr_pfd = {.fd = svr_sock, .events = POLLIN};
+    int unix_sock = -1;
+    struct pollfd svr_pfds[2];
+    nfds_t svr_npfds = 0;
     struct cli_threads clis = {.lh_first = NULL}; // Same as LIST_INIT;
     struct cli_thread *cli;
 
@@ -306,7 +550,33 @@ int main(int argc, char **argv)
             port = (uint16_t)atoi(optarg); // Not going to handle errs
             break;
         case 'f':
-            logfile_path = optarg;
+            store_config.path = optarg;
+            break;
+        case 's':
+            if (0 != store_parse_kind(optarg, &store_config.kind))
+            {
+                fprintf(stderr, "Unknown store '%s'\n", optarg);
+                print_help();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            store_config.ring_entries = (size_t)atol(optarg); // Validated by the store
+            break;
+        case 'b':
+            store_config.ring_bytes = (size_t)atol(optarg);
+            break;
+        case 'S':
+            nshards = (size_t)atol(optarg);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'r':
+            replicate_port = (uint16_t)atoi(optarg);
+            break;
+        case 'F':
+            follow_leader = optarg;
             break;
         case ':':
             fprintf(stderr, "Option '%c' requires an argument\n", (char)optopt);
@@ -317,6 +587,12 @@ int main(int argc, char **argv)
         }
     }
 
+    if ((0 != replicate_port) && (NULL != follow_leader))
+    {
+        fprintf(stderr, "An instance can't both lead and follow\n");
+        exit(EXIT_FAILURE);
+    }
+
     if (0 >= (svr_sock = socket(AF_INET, SOCK_STREAM, 0)))
     {
         perror("failed to allocate socket");
@@ -337,6 +613,27 @@ int main(int argc, char **argv)
         exit(errno);
     }
 
+    if (NULL != unix_path)
+    {
+        if (strlen(unix_path) >= sizeof(unix_addr.sun_path))
+        {
+            fprintf(stderr, "Unix socket path '%s' is too long\n", unix_path);
+            exit(EXIT_FAILURE);
+        }
+        strncpy(unix_addr.sun_path, unix_path, sizeof(unix_addr.sun_path) - 1);
+        if (0 >= (unix_sock = socket(AF_UNIX, SOCK_STREAM, 0)))
+        {
+            perror("failed to allocate unix socket");
+            exit(errno);
+        }
+        unlink(unix_path); // Stale from a previous run, ignore errors
+        if (-1 == bind(unix_sock, (struct sockaddr *)&unix_addr, sizeof(unix_addr)))
+        {
+            perror("failed to bind unix socket");
+            exit(errno);
+        }
+    }
+
     if (daemonize)
     {
         switch (fork())
@@ -356,6 +653,10 @@ int main(int argc, char **argv)
                 break;
             default:
                 close(svr_sock); // Ignore errors
+                if (-1 != unix_sock)
+                {
+                    close(unix_sock); // Path stays, the grandchild owns it
+                }
                 exit(EXIT_SUCCESS);
             }
             if (-1 == chdir("/"))
@@ -371,33 +672,53 @@ int main(int argc, char **argv)
             break;
         default:             // Parent
             close(svr_sock); // Ignore errors
+            if (-1 != unix_sock)
+            {
+                close(unix_sock); // Path stays, the grandchild owns it
+            }
             exit(EXIT_SUCCESS);
         }
     }
 
     openlog(LOG_IDENT, 0, LOG_USER);
 
-    if (0 != pthread_mutex_init(&logfile_mutex, NULL))
+    if (0 == nshards)
     {
-        syslog(LOG_ERR, "failed to create logfile mutex");
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nshards = (cpus > 0) ? (size_t)cpus : 1;
+    }
+    streams = streams_open(&store_config, nshards);
+    if (NULL == streams)
+    {
+        syslog(LOG_ERR, "failed to open store");
         exit(EXIT_FAILURE);
     }
-    // Assume the path exists
-    logfile = open(logfile_path, (O_RDWR | O_CREAT | O_TRUNC), (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
-    if (-1 == logfile)
+
+    if (0 != replicate_port)
     {
-        syslog(LOG_ERR, "failed to open logfile '%s'", logfile_path);
-        exit(errno);
+        replication = replication_lead(streams_default(streams), replicate_port);
+    }
+    else if (NULL != follow_leader)
+    {
+        replication = replication_follow(streams_default(streams), follow_leader);
+    }
+    if (((0 != replicate_port) || (NULL != follow_leader)) && (NULL == replication))
+    {
+        syslog(LOG_ERR, "failed to start replication");
+        exit(EXIT_FAILURE);
     }
 
-    if (-1 == timer_create(CLOCK_REALTIME, &se, &timer_id) ||
-        (-1 == timer_settime(timer_id, 0, &ts, 0)))
+    // Followers get their timestamps from the leader
+    if (!replication_is_follower(replication) &&
+        (-1 == timer_create(CLOCK_REALTIME, &se, &timer_id) ||
+         (-1 == timer_settime(timer_id, 0, &ts, 0))))
     {
         syslog(LOG_ERR, "failed to create and initialize timer");
         exit(errno);
     }
 
-    if (-1 == listen(svr_sock, SVR_BACKLOG))
+    if ((-1 == listen(svr_sock, SVR_BACKLOG)) ||
+        ((-1 != unix_sock) && (-1 == listen(unix_sock, SVR_BACKLOG))))
     {
         syslog(LOG_ERR, "failed to listen to socket");
         exit(errno);
@@ -405,54 +726,73 @@ int main(int argc, char **argv)
 
     if ((-1 == sigemptyset(&sa.sa_mask)) ||
         (-1 == sigaction(SIGINT, &sa, NULL)) ||
-        (-1 == sigaction(SIGTERM, &sa, NULL)))
+        (-1 == sigaction(SIGTERM, &sa, NULL)) ||
+        (-1 == sigemptyset(&sa_ign.sa_mask)) ||
+        (-1 == sigaction(SIGPIPE, &sa_ign, NULL))) // Clients hanging up mid-send
     {
         syslog(LOG_ERR, "failed to set up exit signal handler");
         exit(errno);
     }
 
-    svr_pfd.fd = svr_sock;
+    svr_pfds[svr_npfds++] = (struct pollfd){.fd = svr_sock, .events = POLLIN};
+    if (-1 != unix_sock)
+    {
+        svr_pfds[svr_npfds++] = (struct pollfd){.fd = unix_sock, .events = POLLIN};
+    }
 
     while (running)
     {
-        int cli_sock = -1;
-        struct sockaddr_in cli_addr = {0};
-        socklen_t cli_addrlen = 0;
-
-        if (0 >= poll(&svr_pfd, 1, -1)) // No timeout, just let this handle signals
+        if (0 >= poll(svr_pfds, svr_npfds, -1)) // No timeout, just let this handle signals
         {
             break; // Interrupted, etc
         }
-        if (0 >= (cli_sock = accept(svr_sock, (struct sockaddr *)&cli_addr, &cli_addrlen)))
-        {
-            continue;
-        }
 
-        struct cli_thread *new = malloc(sizeof(struct cli_thread));
-        if (NULL == new)
+        // Both listeners feed the same client handling
+        for (nfds_t i = 0; i < svr_npfds; i++)
         {
-            syslog(LOG_ERR, "failed to allocate space for client thread");
-            exit(errno);
-        }
-        new->data = malloc(sizeof(struct cli_data));
-        if (NULL == new->data)
-        {
-            syslog(LOG_ERR, "failed to allocate space for client thread data");
-            exit(errno);
-        }
-        new->data->addr = cli_addr;
-        new->data->addr_len = cli_addrlen;
-        new->data->sock = cli_sock;
-        new->data->buf = NULL; // sanity
+            int cli_sock = -1;
+            struct sockaddr_storage cli_addr = {0};
+            socklen_t cli_addrlen = sizeof(cli_addr);
 
-        if (0 != pthread_create(&new->thread, NULL, handle_client, (void *)new->data))
-        {
-            syslog(LOG_ERR, "failed to spawn client thread");
-            exit(errno);
+            if (!(svr_pfds[i].revents & POLLIN))
+            {
+                continue;
+            }
+            if (0 >= (cli_sock = accept(svr_pfds[i].fd, (struct sockaddr *)&cli_addr, &cli_addrlen)))
+            {
+                continue;
+            }
+
+            struct cli_thread *new = malloc(sizeof(struct cli_thread));
+            if (NULL == new)
+            {
+                syslog(LOG_ERR, "failed to allocate space for client thread");
+                exit(errno);
+            }
+            new->data = malloc(sizeof(struct cli_data));
+            if (NULL == new->data)
+            {
+                syslog(LOG_ERR, "failed to allocate space for client thread data");
+                exit(errno);
+            }
+            new->data->addr = cli_addr;
+            new->data->addr_len = cli_addrlen;
+            new->data->sock = cli_sock;
+            new->data->buf = NULL; // sanity
+
+            if (0 != pthread_create(&new->thread, NULL, handle_client, (void *)new->data))
+            {
+                syslog(LOG_ERR, "failed to spawn client thread");
+                exit(errno);
+            }
+            LIST_INSERT_HEAD(&clis, new, entries);
         }
-        LIST_INSERT_HEAD(&clis, new, entries);
     }
 
+    // Release anyone following the log, then the replication threads
+    streams_shutdown(streams);
+    replication_stop(replication);
+
     // Deallocate client handler list
     cli = LIST_FIRST(&clis);
     while (cli != NULL)
@@ -474,9 +814,17 @@ int main(int argc, char **argv)
     }
 
     // Ignore errors
-    remove(logfile_path);
-    pthread_mutex_destroy(&logfile_mutex);
+    if (!replication_is_follower(replication))
+    {
+        timer_delete(timer_id);
+    }
+    streams_close(streams);
     close(svr_sock);
+    if (-1 != unix_sock)
+    {
+        close(unix_sock);
+        unlink(unix_path);
+    }
     closelog();
     return EXIT_SUCCESS;
 }
\ No newline at end of file
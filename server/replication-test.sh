@@ -0,0 +1,210 @@
+#!/bin/sh
+# Run a leader with a file and a ring follower on local ports, write through
+# the leader (including a concurrent burst) and check every node ends up with
+# the same log at the same offsets, and that followers refuse writes.
+#  Usage: replication-test.sh [BASE_PORT [BURST]]
+
+set -e
+set -u
+
+CURDIR="$(realpath "$(dirname "$0")" || echo ".")"
+AESDSOCKET="${CURDIR}/build/aesdsocket"
+BASEPORT="${1:-9100}"
+BURST="${2:-200}"
+RING_ENTRIES=5
+TESTDIR=/tmp/aesd-replication-test
+PIDS=""
+FAILED=0
+
+[ -x "${AESDSOCKET}" ] || { >&2 echo "Build aesdsocket first (make)"; exit 1; }
+
+cleanup() {
+	[ -n "${PIDS}" ] && kill ${PIDS} 2>/dev/null || true
+	wait 2>/dev/null || true
+	PIDS=""
+}
+trap cleanup EXIT INT TERM
+
+# Send stdin to the server on port $1 and print its reply
+aesd() {
+	if command -v nc > /dev/null; then
+		nc -w 1 localhost "$1"
+	else
+		python3 -c '
+import socket, sys
+s = socket.create_connection(("localhost", int(sys.argv[1])))
+s.sendall(sys.stdin.buffer.read())
+s.shutdown(socket.SHUT_WR)
+s.settimeout(1)
+try:
+    while True:
+        data = s.recv(65536)
+        if not data:
+            break
+        sys.stdout.buffer.write(data)
+except socket.timeout:
+    pass
+' "$1"
+	fi
+}
+
+status() {
+	echo "AESDSOCKET_STATUS:" | aesd "$1"
+}
+
+# Print the value of key $2 in the status of port $1
+status_value() {
+	status "$1" | sed -n "s/^$2:\(.*\)$/\1/p" | head -n 1
+}
+
+start() {
+	"${AESDSOCKET}" "$@" &
+	PIDS="${PIDS} $!"
+}
+
+wait_ready() {
+	for _ in $(seq 1 50); do
+		[ -n "$(status "$1")" ] && return 0
+		sleep 0.1
+	done
+	>&2 echo "aesdsocket on port $1 did not start"
+	exit 1
+}
+
+# Wait for the follower on port $1 to be connected and level with the leader
+wait_caught_up() {
+	for _ in $(seq 1 50); do
+		[ "$(status_value "$1" connected)" = "1" ] && [ "$(status_value "$1" lag_bytes)" = "0" ] &&
+			[ "$(status_value "$1" committed)" = "$(status_value "${LEADER}" committed)" ] && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+check() {
+	if [ "$2" = "$3" ]; then
+		echo "  ok: $1"
+	else
+		echo "  FAILED: $1 ('$2' != '$3')"
+		FAILED=1
+	fi
+}
+
+start_leader() {
+	"${AESDSOCKET}" -p "${LEADER}" -r "${REPL}" -s "${LEADER_STORE}" -n "${RING_ENTRIES}" -f "${TESTDIR}/leader" &
+	LEADER_PID="$!"
+	PIDS="${PIDS} ${LEADER_PID}"
+	wait_ready "${LEADER}"
+}
+
+# Check every follower holds what the leader does, at the same offsets
+compare() {
+	echo " $1"
+	# Retry if a timestamp line lands while we're reading the logs
+	for _ in 1 2 3; do
+		for PORT in ${FOLLOWERS}; do
+			wait_caught_up "${PORT}" || true
+		done
+		COMMITTED="$(status_value "${LEADER}" committed)"
+		LEADER_LOG="$(echo "AESDSOCKET_READ:0" | aesd "${LEADER}")"
+		FILE_LOG="$(echo "AESDSOCKET_READ:0" | aesd "${FILE_FOLLOWER}")"
+		RING_LOG="$(echo "AESDSOCKET_READ:0" | aesd "${RING_FOLLOWER}")"
+		LATE_LOG="$([ -z "${LATE_FOLLOWER}" ] || echo "AESDSOCKET_READ:0" | aesd "${LATE_FOLLOWER}")"
+		[ "$(status_value "${LEADER}" committed)" = "${COMMITTED}" ] && break
+	done
+	# A ring follower keeps the leader's last entries, which for a file
+	# leader are its lines
+	if [ "${LEADER_STORE}" = ring ]; then
+		RING_EXPECTED="${LEADER_LOG}"
+	else
+		RING_EXPECTED="$(echo "${LEADER_LOG}" | tail -n "${RING_ENTRIES}")"
+	fi
+
+	check "ring follower log matches the leader's" "${RING_LOG}" "${RING_EXPECTED}"
+	if [ -n "${LATE_FOLLOWER}" ]; then
+		check "late ring follower log matches the leader's" "${LATE_LOG}" "${RING_EXPECTED}"
+	fi
+	if [ "${LEADER_STORE}" = file ]; then
+		check "file follower log matches the leader's" "${FILE_LOG}" "${LEADER_LOG}"
+	else
+		# Whatever the file follower caught before the ring evicted it stays
+		check "file follower log ends with the leader's" \
+			"$(echo "${FILE_LOG}" | tail -n "$(echo "${LEADER_LOG}" | wc -l)")" "${LEADER_LOG}"
+	fi
+	for PORT in ${FOLLOWERS}; do
+		check "follower on ${PORT} is at the leader's offset" "$(status_value "${PORT}" committed)" "${COMMITTED}"
+		check "follower on ${PORT} has no lag" "$(status_value "${PORT}" lag_bytes)" "0"
+	done
+	check "leader sees no follower lag" \
+		"$(status "${LEADER}" | grep '^follower:' | grep -vc 'lag_bytes:0$' || true)" "0"
+}
+
+# Leader store $1, a file follower and a ring follower of RING_ENTRIES lines
+run() {
+	LEADER_STORE="$1"
+	LEADER="${BASEPORT}"
+	REPL="$((BASEPORT + 1))"
+	FILE_FOLLOWER="$((BASEPORT + 2))"
+	RING_FOLLOWER="$((BASEPORT + 3))"
+	LATE_FOLLOWER=""
+	FOLLOWERS="${FILE_FOLLOWER} ${RING_FOLLOWER}"
+
+	echo "${LEADER_STORE} leader, file and ring (${RING_ENTRIES} lines) followers"
+	rm -rf "${TESTDIR}"
+	mkdir -p "${TESTDIR}"
+	start_leader
+	start -p "${FILE_FOLLOWER}" -F "localhost:${REPL}" -s file -f "${TESTDIR}/file"
+	start -p "${RING_FOLLOWER}" -F "localhost:${REPL}" -s ring -n "${RING_ENTRIES}" -f "${TESTDIR}/ring"
+	wait_ready "${FILE_FOLLOWER}"
+	wait_ready "${RING_FOLLOWER}"
+
+	for i in $(seq 1 10); do
+		echo "sequential ${i}" | aesd "${LEADER}" > /dev/null
+	done
+	CLIENTS=""
+	for i in $(seq 1 "${BURST}"); do
+		echo "burst ${i}" | aesd "${LEADER}" > /dev/null &
+		CLIENTS="${CLIENTS} $!"
+	done
+	wait ${CLIENTS}
+	echo "after the burst" | aesd "${LEADER}" > /dev/null
+
+	compare "after ${BURST} concurrent writes"
+	LEADER_LOG="$(echo "AESDSOCKET_READ:0" | aesd "${LEADER}")"
+	if [ "${LEADER_STORE}" = ring ]; then
+		check "leader keeps the last ${RING_ENTRIES} lines" "$(echo "${LEADER_LOG}" | wc -l)" "${RING_ENTRIES}"
+	else
+		# Not counting the timestamp lines the server adds every 10 seconds
+		check "leader keeps every line" "$(echo "${LEADER_LOG}" | grep -vc '^timestamp:' || true)" "$((BURST + 11))"
+	fi
+	for PORT in ${FOLLOWERS}; do
+		echo "written to a follower" | aesd "${PORT}" > /dev/null || true
+		check "follower on ${PORT} refuses writes" \
+			"$(echo "AESDSOCKET_READ:0" | aesd "${PORT}" | grep -c "written to a follower" || true)" "0"
+	done
+
+	# Joins long after the start of the log, which a ring leader has evicted
+	LATE_FOLLOWER="$((BASEPORT + 4))"
+	FOLLOWERS="${FOLLOWERS} ${LATE_FOLLOWER}"
+	start -p "${LATE_FOLLOWER}" -F "localhost:${REPL}" -s ring -n "${RING_ENTRIES}" -f "${TESTDIR}/late"
+	wait_ready "${LATE_FOLLOWER}"
+	echo "after the late follower" | aesd "${LEADER}" > /dev/null
+	compare "after a follower joined late"
+
+	# A restarted leader starts a new log, shorter than the followers' copies
+	kill "${LEADER_PID}"
+	wait "${LEADER_PID}" || true
+	start_leader
+	# Quickly write more than the followers hold, before they reconnect, as
+	# one entry
+	seq 1 "$((BURST * 2))" | sed 's/^/restarted /' | aesd "${LEADER}" > /dev/null
+	compare "after the leader restarted"
+
+	cleanup
+}
+
+run file
+run ring
+
+rm -rf "${TESTDIR}"
+[ "${FAILED}" = 0 ] && echo "All replication checks passed" || { echo "Replication checks failed"; exit 1; }
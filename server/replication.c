@@ -0,0 +1,895 @@
+/*
+ * ianmclinden, 2024
+ */
+
+#include "replication.h"
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * First line a follower sends, followed by "<offset>:<log id>", the leader
+ * offset to resume from and the leader log it holds (0 for none yet)
+ */
+#define REPL_HELLO "AESDSOCKET_REPLICATE:"
+#define REPL_HELLO_MAX 80
+#define REPL_MAGIC 0x52504c32u // "RPL2"
+#define REPL_HDR_SIZE 48
+/**
+ * Most records one frame describes, each costs a u32 length on the wire
+ */
+#define REPL_BATCH_RECORDS 4096
+/**
+ * The frame's last record carries on in the next frame
+ */
+#define REPL_FLAG_PARTIAL 0x1u
+/**
+ * The follower's log isn't this leader's, drop it and start again at offset
+ */
+#define REPL_FLAG_RESET 0x2u
+#define REPL_BACKLOG 4
+/**
+ * Idle leaders send an empty frame this often, so followers can tell a quiet
+ * log from a dead link and keep their lag current
+ */
+#define REPL_HEARTBEAT_MS 1000
+/**
+ * Socket timeout, bounds how long any replication thread takes to notice
+ * replication_stop()
+ */
+#define REPL_IO_TIMEOUT_MS 1000
+#define REPL_DEAD_MS (3 * REPL_HEARTBEAT_MS)
+#define REPL_RETRY_MS 1000
+
+/**
+ * Frame header, sent big endian as 4 u64 and 4 u32 fields, followed by nrecs
+ * u32 record lengths and then len bytes of log data. A record is one leader
+ * append, so a follower can commit exactly the entries its leader did.
+ */
+struct repl_frame
+{
+    /**
+     * Leader offset of the first data byte
+     */
+    uint64_t offset;
+    /**
+     * Leader end of log as of this frame
+     */
+    uint64_t committed;
+    /**
+     * Leader CLOCK_REALTIME when the frame was sent
+     */
+    uint64_t sent_ns;
+    /**
+     * Which leader log the offsets are in, see struct replication
+     */
+    uint64_t log_id;
+    /**
+     * Data bytes that follow, 0 for a heartbeat
+     */
+    uint32_t len;
+    /**
+     * Records the data splits into, their lengths add up to len
+     */
+    uint32_t nrecs;
+    uint32_t flags;
+};
+
+struct repl_peer
+{
+    pthread_t thread;
+    struct replication *repl;
+    int sock;
+    char addr[INET_ADDRSTRLEN];
+    size_t sent;
+    /**
+     * Follower's applied offset, from its acks
+     */
+    size_t acked;
+    bool done;
+    LIST_ENTRY(repl_peer)
+    entries;
+};
+
+LIST_HEAD(repl_peers, repl_peer);
+
+struct replication
+{
+    bool follower;
+    struct store *store;
+    volatile bool stopping;
+    pthread_t thread;
+    /**
+     * Guards peers and the follower progress
+     */
+    pthread_mutex_t lock;
+    /**
+     * Tells one run of a leader's log from another, so a follower can't
+     * resume a log the leader no longer has. The leader's start time, and
+     * for a follower that of the leader it holds the log of, 0 until the
+     * first frame.
+     */
+    uint64_t log_id;
+
+    // Leader
+    int sock;
+    struct repl_peers peers;
+
+    // Follower
+    char *host;
+    char *port;
+    bool connected;
+    size_t applied;
+    size_t leader_committed;
+    uint64_t leader_ns;
+    /**
+     * Leader time of the last frame after which nothing was left to apply
+     */
+    uint64_t caught_up_ns;
+    /**
+     * Local CLOCK_MONOTONIC of the last frame
+     */
+    uint64_t contact_ns;
+};
+
+static uint64_t clock_ns(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void repl_frame_encode(const struct repl_frame *frame, uint8_t hdr[REPL_HDR_SIZE])
+{
+    uint64_t u64;
+    uint32_t u32;
+
+    u64 = htobe64(frame->offset);
+    memcpy(hdr, &u64, sizeof(u64));
+    u64 = htobe64(frame->committed);
+    memcpy(hdr + 8, &u64, sizeof(u64));
+    u64 = htobe64(frame->sent_ns);
+    memcpy(hdr + 16, &u64, sizeof(u64));
+    u64 = htobe64(frame->log_id);
+    memcpy(hdr + 24, &u64, sizeof(u64));
+    u32 = htobe32(frame->len);
+    memcpy(hdr + 32, &u32, sizeof(u32));
+    u32 = htobe32(frame->nrecs);
+    memcpy(hdr + 36, &u32, sizeof(u32));
+    u32 = htobe32(frame->flags);
+    memcpy(hdr + 40, &u32, sizeof(u32));
+    u32 = htobe32(REPL_MAGIC);
+    memcpy(hdr + 44, &u32, sizeof(u32));
+}
+
+static bool repl_frame_decode(const uint8_t hdr[REPL_HDR_SIZE], struct repl_frame *frame)
+{
+    uint64_t u64;
+    uint32_t u32;
+
+    memcpy(&u32, hdr + 44, sizeof(u32));
+    if (REPL_MAGIC != be32toh(u32))
+    {
+        return false;
+    }
+    memcpy(&u64, hdr, sizeof(u64));
+    frame->offset = be64toh(u64);
+    memcpy(&u64, hdr + 8, sizeof(u64));
+    frame->committed = be64toh(u64);
+    memcpy(&u64, hdr + 16, sizeof(u64));
+    frame->sent_ns = be64toh(u64);
+    memcpy(&u64, hdr + 24, sizeof(u64));
+    frame->log_id = be64toh(u64);
+    memcpy(&u32, hdr + 32, sizeof(u32));
+    frame->len = be32toh(u32);
+    memcpy(&u32, hdr + 36, sizeof(u32));
+    frame->nrecs = be32toh(u32);
+    memcpy(&u32, hdr + 40, sizeof(u32));
+    frame->flags = be32toh(u32);
+    return true;
+}
+
+static void repl_set_sockopts(int sock)
+{
+    struct timeval tv = {
+        .tv_sec = REPL_IO_TIMEOUT_MS / 1000,
+        .tv_usec = (REPL_IO_TIMEOUT_MS % 1000) * 1000,
+    };
+
+    // Ignore errors, these only affect latency and shutdown time
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    // Frames are already batched, don't let Nagle hold back the last one
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+}
+
+// Write all of iov, riding out send timeouts until we're stopped
+static int repl_send(struct replication *repl, int sock, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t wrote = writev(sock, iov, iovcnt);
+        if (-1 == wrote)
+        {
+            if (((EINTR == errno) || (EAGAIN == errno)) && !repl->stopping)
+            {
+                continue;
+            }
+            return -1;
+        }
+        while ((iovcnt > 0) && ((size_t)wrote >= iov->iov_len))
+        {
+            wrote -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + wrote;
+            iov->iov_len -= (size_t)wrote;
+        }
+    }
+    return 0;
+}
+
+// Read exactly len bytes, giving up if the peer goes quiet for REPL_DEAD_MS
+static int repl_recv(struct replication *repl, int sock, void *buf, size_t len)
+{
+    char *p = buf;
+    size_t got = 0;
+    uint64_t idle_since = clock_ns(CLOCK_MONOTONIC);
+
+    while (got < len)
+    {
+        ssize_t rd = recv(sock, p + got, len - got, 0);
+        if (0 < rd)
+        {
+            got += (size_t)rd;
+            idle_since = clock_ns(CLOCK_MONOTONIC);
+            continue;
+        }
+        if ((0 == rd) || repl->stopping || ((EINTR != errno) && (EAGAIN != errno)))
+        {
+            return -1;
+        }
+        if (clock_ns(CLOCK_MONOTONIC) - idle_since > REPL_DEAD_MS * 1000000ull)
+        {
+            syslog(LOG_WARNING, "replication peer silent for %d ms", REPL_DEAD_MS);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Sleep up to ms, waking early if we're stopped
+static void repl_pause(struct replication *repl, int ms)
+{
+    for (int slept = 0; (slept < ms) && !repl->stopping; slept += 100)
+    {
+        poll(NULL, 0, 100);
+    }
+}
+
+static struct replication *repl_alloc(struct store *store, bool follower)
+{
+    struct replication *repl = malloc(sizeof(struct replication));
+
+    if (NULL == repl)
+    {
+        syslog(LOG_ERR, "failed to allocate replication state");
+        return NULL;
+    }
+    memset(repl, 0, sizeof(struct replication));
+    repl->store = store;
+    repl->follower = follower;
+    repl->sock = -1;
+    LIST_INIT(&repl->peers);
+    if (0 != pthread_mutex_init(&repl->lock, NULL))
+    {
+        syslog(LOG_ERR, "failed to create replication mutex");
+        free(repl);
+        return NULL;
+    }
+    return repl;
+}
+
+static void repl_free(struct replication *repl)
+{
+    if (-1 != repl->sock)
+    {
+        close(repl->sock);
+    }
+    pthread_mutex_destroy(&repl->lock);
+    free(repl->host);
+    free(repl->port);
+    free(repl);
+}
+
+// Leader side, one per follower: ship everything past the follower's offset,
+// then each new batch as it's committed, never waiting on acks
+static void *repl_peer_thread(void *peer_param)
+{
+    struct repl_peer *peer = (struct repl_peer *)peer_param;
+    struct replication *repl = peer->repl;
+    struct repl_frame frame;
+    uint8_t hdr[REPL_HDR_SIZE];
+    uint8_t ack[sizeof(uint64_t)];
+    size_t ack_have = 0;
+    char hello[REPL_HELLO_MAX] = {0};
+    char *rest;
+    uint64_t log_id;
+    uint32_t reset = 0;
+    size_t have = 0;
+    size_t offset;
+    size_t end;
+    size_t committed;
+    size_t nrecs;
+    bool partial;
+    ssize_t n;
+    int rc;
+    char *buf = malloc(REPL_BATCH_BYTES);
+    size_t *lens = malloc(REPL_BATCH_RECORDS * sizeof(size_t));
+    uint32_t *wire_lens = malloc(REPL_BATCH_RECORDS * sizeof(uint32_t));
+
+    if ((NULL == buf) || (NULL == lens) || (NULL == wire_lens))
+    {
+        syslog(LOG_ERR, "failed to allocate replication buffer for %s", peer->addr);
+        goto done;
+    }
+
+    // Handshake, where the follower's log ends
+    while ((NULL == strchr(hello, '\n')) && (have < sizeof(hello) - 1))
+    {
+        n = recv(peer->sock, hello + have, sizeof(hello) - 1 - have, 0);
+        if (0 < n)
+        {
+            have += (size_t)n;
+        }
+        else if ((0 == n) || repl->stopping || ((EINTR != errno) && (EAGAIN != errno)))
+        {
+            goto done;
+        }
+    }
+    if ((NULL == strchr(hello, '\n')) || (0 != strncmp(hello, REPL_HELLO, strlen(REPL_HELLO))))
+    {
+        syslog(LOG_ERR, "bad replication handshake from %s", peer->addr);
+        goto done;
+    }
+    offset = (size_t)strtoull(hello + strlen(REPL_HELLO), &rest, 10);
+    log_id = (':' == *rest) ? strtoull(rest + 1, NULL, 10) : 0;
+    if (((0 != log_id) && (log_id != repl->log_id)) || (offset > store_committed(repl->store)))
+    {
+        // Most likely we restarted, whatever it holds isn't in our log
+        syslog(LOG_WARNING, "%s holds another log up to offset %zu, resetting it", peer->addr, offset);
+        offset = 0;
+        reset = REPL_FLAG_RESET;
+    }
+    syslog(LOG_DEBUG, "Replicating to %s from offset %zu", peer->addr, offset);
+
+    while (!repl->stopping)
+    {
+        committed = store_committed(repl->store);
+        end = offset;
+        nrecs = REPL_BATCH_RECORDS;
+        if (0 > (n = store_read_records(repl->store, &end, buf, REPL_BATCH_BYTES, lens, &nrecs, &partial)))
+        {
+            break;
+        }
+        if (0 == n)
+        {
+            if (-1 == (rc = store_wait(repl->store, offset, REPL_HEARTBEAT_MS)))
+            {
+                break; // Shutting down
+            }
+            if (1 == rc)
+            {
+                continue;
+            }
+            // Quiet for a whole interval, fall through to a heartbeat
+        }
+
+        frame.offset = end - (size_t)n;
+        frame.committed = (committed > end) ? committed : end;
+        frame.sent_ns = clock_ns(CLOCK_REALTIME);
+        frame.log_id = repl->log_id;
+        frame.len = (uint32_t)n;
+        frame.nrecs = (uint32_t)nrecs;
+        frame.flags = (partial ? REPL_FLAG_PARTIAL : 0) | reset;
+        repl_frame_encode(&frame, hdr);
+        for (size_t i = 0; i < nrecs; i++)
+        {
+            wire_lens[i] = htobe32((uint32_t)lens[i]);
+        }
+        if (0 != repl_send(repl, peer->sock,
+                           (struct iovec[]){{.iov_base = hdr, .iov_len = sizeof(hdr)},
+                                            {.iov_base = wire_lens, .iov_len = nrecs * sizeof(uint32_t)},
+                                            {.iov_base = buf, .iov_len = (size_t)n}},
+                           3))
+        {
+            break;
+        }
+        offset = end;
+        reset = 0;
+
+        // Pick up whatever acks have arrived, without waiting for any
+        while (0 < (n = recv(peer->sock, ack + ack_have, sizeof(ack) - ack_have, MSG_DONTWAIT)))
+        {
+            ack_have += (size_t)n;
+            if (sizeof(ack) == ack_have)
+            {
+                uint64_t u64;
+                memcpy(&u64, ack, sizeof(u64));
+                pthread_mutex_lock(&repl->lock);
+                peer->acked = be64toh(u64);
+                pthread_mutex_unlock(&repl->lock);
+                ack_have = 0;
+            }
+        }
+        if ((0 == n) || ((EAGAIN != errno) && (EINTR != errno)))
+        {
+            break; // Follower hung up
+        }
+
+        pthread_mutex_lock(&repl->lock);
+        peer->sent = offset;
+        pthread_mutex_unlock(&repl->lock);
+    }
+
+done:
+    syslog(LOG_DEBUG, "Stopped replicating to %s", peer->addr);
+    free(buf);
+    free(lens);
+    free(wire_lens);
+    close(peer->sock);
+    pthread_mutex_lock(&repl->lock);
+    peer->done = true;
+    pthread_mutex_unlock(&repl->lock);
+    return NULL;
+}
+
+// Join finished peer threads, or every one of them if all
+static void repl_reap(struct replication *repl, bool all)
+{
+    struct repl_peers reaped = {.lh_first = NULL}; // Same as LIST_INIT;
+    struct repl_peer *peer;
+    struct repl_peer *next;
+
+    pthread_mutex_lock(&repl->lock);
+    for (peer = LIST_FIRST(&repl->peers); NULL != peer; peer = next)
+    {
+        next = LIST_NEXT(peer, entries);
+        if (all || peer->done)
+        {
+            LIST_REMOVE(peer, entries);
+            LIST_INSERT_HEAD(&reaped, peer, entries);
+        }
+    }
+    pthread_mutex_unlock(&repl->lock);
+
+    // Peers take the lock to report progress, so join without it
+    for (peer = LIST_FIRST(&reaped); NULL != peer; peer = next)
+    {
+        next = LIST_NEXT(peer, entries);
+        pthread_join(peer->thread, NULL);
+        free(peer);
+    }
+}
+
+static void *repl_accept_thread(void *repl_param)
+{
+    struct replication *repl = (struct replication *)repl_param;
+    struct pollfd pfd = {.fd = repl->sock, .events = POLLIN};
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    struct repl_peer *peer;
+    int sock;
+
+    while (!repl->stopping)
+    {
+        repl_reap(repl, false);
+        if (0 >= poll(&pfd, 1, REPL_IO_TIMEOUT_MS))
+        {
+            continue; // Timeout, check whether we're stopping
+        }
+        addrlen = sizeof(addr);
+        if (-1 == (sock = accept(repl->sock, (struct sockaddr *)&addr, &addrlen)))
+        {
+            continue;
+        }
+
+        peer = malloc(sizeof(struct repl_peer));
+        if (NULL == peer)
+        {
+            syslog(LOG_ERR, "failed to allocate replication peer");
+            close(sock);
+            continue;
+        }
+        memset(peer, 0, sizeof(struct repl_peer));
+        peer->repl = repl;
+        peer->sock = sock;
+        inet_ntop(AF_INET, &addr.sin_addr, peer->addr, sizeof(peer->addr));
+        repl_set_sockopts(sock);
+
+        pthread_mutex_lock(&repl->lock);
+        if (0 != pthread_create(&peer->thread, NULL, repl_peer_thread, peer))
+        {
+            pthread_mutex_unlock(&repl->lock);
+            syslog(LOG_ERR, "failed to spawn replication thread for %s", peer->addr);
+            close(sock);
+            free(peer);
+            continue;
+        }
+        LIST_INSERT_HEAD(&repl->peers, peer, entries);
+        pthread_mutex_unlock(&repl->lock);
+    }
+    return NULL;
+}
+
+struct replication *replication_lead(struct store *store, uint16_t port)
+{
+    struct sockaddr_in bind_addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = INADDR_ANY,
+        .sin_port = htons(port),
+    };
+    struct replication *repl = repl_alloc(store, false);
+
+    if (NULL == repl)
+    {
+        return NULL;
+    }
+    repl->log_id = clock_ns(CLOCK_REALTIME);
+    if ((-1 == (repl->sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0))) ||
+        (-1 == setsockopt(repl->sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int))) ||
+        (-1 == bind(repl->sock, (struct sockaddr *)&bind_addr, sizeof(bind_addr))) ||
+        (-1 == listen(repl->sock, REPL_BACKLOG)))
+    {
+        syslog(LOG_ERR, "failed to listen for followers on port %u: %s", port, strerror(errno));
+        repl_free(repl);
+        return NULL;
+    }
+    if (0 != pthread_create(&repl->thread, NULL, repl_accept_thread, repl))
+    {
+        syslog(LOG_ERR, "failed to spawn replication listener");
+        repl_free(repl);
+        return NULL;
+    }
+    return repl;
+}
+
+static int repl_connect(struct replication *repl)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    int sock = -1;
+
+    if (0 != getaddrinfo(repl->host, repl->port, &hints, &res))
+    {
+        return -1;
+    }
+    for (ai = res; (NULL != ai) && (-1 == sock); ai = ai->ai_next)
+    {
+        sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if ((-1 != sock) && (-1 == connect(sock, ai->ai_addr, ai->ai_addrlen)))
+        {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return sock;
+}
+
+// Check that a frame's record lengths, still big endian, cover its data
+static bool repl_lens_valid(const struct repl_frame *frame, const uint32_t *lens)
+{
+    uint64_t total = 0;
+
+    for (uint32_t i = 0; i < frame->nrecs; i++)
+    {
+        total += be32toh(lens[i]);
+    }
+    return (total == frame->len) && ((0 == (frame->flags & REPL_FLAG_PARTIAL)) || (0 < frame->nrecs));
+}
+
+// Commit one store entry per leader record, so a follower's entries (and a
+// ring follower's evictions) are its leader's. buf holds the carry bytes of a
+// record the previous frame cut short, then this frame's data, so the first
+// record finishes that one. A record this frame cuts short is left in buf.
+// @param used set to the bytes committed
+// @return 0 on success, -1 if the store failed part way
+static int repl_apply(struct replication *repl, const char *buf, size_t carry, const struct repl_frame *frame,
+                      const uint32_t *lens, size_t *used)
+{
+    uint32_t nrecs = frame->nrecs - ((0 != (frame->flags & REPL_FLAG_PARTIAL)) ? 1 : 0);
+
+    *used = 0;
+    for (uint32_t i = 0; i < nrecs; i++)
+    {
+        size_t len = be32toh(lens[i]) + ((0 == i) ? carry : 0);
+        if (0 != store_append(repl->store, buf + *used, len))
+        {
+            syslog(LOG_ERR, "failed to apply a replicated record");
+            return -1;
+        }
+        *used += len;
+    }
+    return 0;
+}
+
+// Drop our log and continue it at the leader's @param offset
+static int repl_rebase(struct replication *repl, size_t offset)
+{
+    if (0 != store_rebase(repl->store, offset))
+    {
+        syslog(LOG_ERR, "failed to move the log to leader offset %zu", offset);
+        return -1;
+    }
+    pthread_mutex_lock(&repl->lock);
+    repl->applied = offset;
+    pthread_mutex_unlock(&repl->lock);
+    return 0;
+}
+
+static void *repl_follow_thread(void *repl_param)
+{
+    struct replication *repl = (struct replication *)repl_param;
+    struct repl_frame frame;
+    uint8_t hdr[REPL_HDR_SIZE];
+    char hello[REPL_HELLO_MAX];
+    char *buf = NULL;
+    size_t cap = 0;
+    size_t carry;
+    size_t used;
+    uint64_t ack;
+    int sock;
+    int rc;
+    uint32_t *lens = malloc(REPL_BATCH_RECORDS * sizeof(uint32_t));
+
+    if (NULL == lens)
+    {
+        syslog(LOG_ERR, "failed to allocate replication buffer");
+        return NULL;
+    }
+
+    while (!repl->stopping)
+    {
+        if (-1 == (sock = repl_connect(repl)))
+        {
+            repl_pause(repl, REPL_RETRY_MS);
+            continue;
+        }
+        repl_set_sockopts(sock);
+
+        // Resume from the last complete record, anything partial is resent
+        carry = 0;
+        snprintf(hello, sizeof(hello), "%s%zu:%llu\n", REPL_HELLO, repl->applied, (unsigned long long)repl->log_id);
+        if (0 != repl_send(repl, sock, (struct iovec[]){{.iov_base = hello, .iov_len = strlen(hello)}}, 1))
+        {
+            close(sock);
+            repl_pause(repl, REPL_RETRY_MS);
+            continue;
+        }
+        syslog(LOG_DEBUG, "Following leader %s:%s from offset %zu", repl->host, repl->port, repl->applied);
+        pthread_mutex_lock(&repl->lock);
+        repl->connected = true;
+        pthread_mutex_unlock(&repl->lock);
+
+        while (!repl->stopping)
+        {
+            if (0 != repl_recv(repl, sock, hdr, sizeof(hdr)))
+            {
+                break;
+            }
+            if (!repl_frame_decode(hdr, &frame) || (frame.len > REPL_BATCH_BYTES) ||
+                (frame.nrecs > REPL_BATCH_RECORDS))
+            {
+                syslog(LOG_ERR, "bad replication frame from %s:%s", repl->host, repl->port);
+                break;
+            }
+            if (0 != repl_recv(repl, sock, lens, frame.nrecs * sizeof(uint32_t)))
+            {
+                break;
+            }
+            if (!repl_lens_valid(&frame, lens))
+            {
+                syslog(LOG_ERR, "bad replication frame from %s:%s", repl->host, repl->port);
+                break;
+            }
+            if ((0 != (frame.flags & REPL_FLAG_RESET)) || (frame.log_id != repl->log_id))
+            {
+                // First contact, or the leader's log was replaced under us
+                if (0 != repl->log_id)
+                {
+                    syslog(LOG_WARNING, "leader %s:%s has a new log, discarding ours", repl->host, repl->port);
+                }
+                if (0 != repl_rebase(repl, frame.offset))
+                {
+                    break;
+                }
+                carry = 0;
+                repl->log_id = frame.log_id;
+            }
+            else if ((0 != frame.len) && (frame.offset != repl->applied + carry))
+            {
+                // Only a ring leader does this. Start over at its offset,
+                // keeping what we have would shift ours by the gap.
+                syslog(LOG_WARNING, "leader skipped from offset %zu to %zu, evicted before it was replicated",
+                       repl->applied + carry, (size_t)frame.offset);
+                if (0 != repl_rebase(repl, frame.offset))
+                {
+                    break;
+                }
+                carry = 0;
+            }
+            if (carry + frame.len > cap)
+            {
+                char *grown = realloc(buf, carry + frame.len);
+                if (NULL == grown)
+                {
+                    syslog(LOG_ERR, "failed to allocate replication buffer");
+                    break;
+                }
+                buf = grown;
+                cap = carry + frame.len;
+            }
+            if (0 != repl_recv(repl, sock, buf + carry, frame.len))
+            {
+                break;
+            }
+
+            rc = repl_apply(repl, buf, carry, &frame, lens, &used);
+            carry = carry + frame.len - used;
+            memmove(buf, buf + used, carry);
+
+            pthread_mutex_lock(&repl->lock);
+            repl->applied += used;
+            repl->leader_committed = frame.committed;
+            repl->leader_ns = frame.sent_ns;
+            if ((repl->applied >= frame.committed) || (0 == repl->caught_up_ns))
+            {
+                repl->caught_up_ns = frame.sent_ns;
+            }
+            repl->contact_ns = clock_ns(CLOCK_MONOTONIC);
+            ack = htobe64(repl->applied);
+            pthread_mutex_unlock(&repl->lock);
+
+            if ((0 != rc) || (0 != repl_send(repl, sock, (struct iovec[]){{.iov_base = &ack, .iov_len = sizeof(ack)}}, 1)))
+            {
+                break;
+            }
+        }
+
+        close(sock);
+        pthread_mutex_lock(&repl->lock);
+        repl->connected = false;
+        pthread_mutex_unlock(&repl->lock);
+        if (!repl->stopping)
+        {
+            syslog(LOG_WARNING, "lost leader %s:%s, reconnecting", repl->host, repl->port);
+            repl_pause(repl, REPL_RETRY_MS);
+        }
+    }
+
+    free(buf);
+    free(lens);
+    return NULL;
+}
+
+struct replication *replication_follow(struct store *store, const char *leader)
+{
+    const char *colon = strrchr(leader, ':');
+    struct replication *repl;
+
+    if ((NULL == colon) || (colon == leader) || ('\0' == colon[1]))
+    {
+        syslog(LOG_ERR, "leader '%s' is not HOST:PORT", leader);
+        return NULL;
+    }
+    if (0 != store_committed(store))
+    {
+        syslog(LOG_ERR, "a follower's store must start empty");
+        return NULL;
+    }
+
+    repl = repl_alloc(store, true);
+    if (NULL == repl)
+    {
+        return NULL;
+    }
+    repl->host = strndup(leader, (size_t)(colon - leader));
+    repl->port = strdup(colon + 1);
+    if ((NULL == repl->host) || (NULL == repl->port))
+    {
+        syslog(LOG_ERR, "failed to allocate replication state");
+        repl_free(repl);
+        return NULL;
+    }
+    if (0 != pthread_create(&repl->thread, NULL, repl_follow_thread, repl))
+    {
+        syslog(LOG_ERR, "failed to spawn replication follower");
+        repl_free(repl);
+        return NULL;
+    }
+    return repl;
+}
+
+bool replication_is_follower(const struct replication *repl)
+{
+    return (NULL != repl) && repl->follower;
+}
+
+int replication_status(struct replication *repl, struct store *store, char *buf, size_t size)
+{
+    size_t committed = store_committed(store);
+    struct repl_peer *peer;
+    size_t lag_bytes;
+    int len;
+
+    if (NULL == repl)
+    {
+        return snprintf(buf, size, "role:standalone\ncommitted:%zu\n", committed);
+    }
+
+    pthread_mutex_lock(&repl->lock);
+    if (repl->follower)
+    {
+        lag_bytes = (repl->leader_committed > repl->applied) ? repl->leader_committed - repl->applied : 0;
+        len = snprintf(buf, size,
+                       "role:follower\nleader:%s:%s\nconnected:%d\ncommitted:%zu\napplied:%zu\n"
+                       "leader_committed:%zu\nlag_bytes:%zu\nlag_ms:%llu\nlast_contact_ms:%lld\n",
+                       repl->host, repl->port, repl->connected, committed, repl->applied,
+                       repl->leader_committed, lag_bytes,
+                       (0 == lag_bytes) ? 0ull : (unsigned long long)((repl->leader_ns - repl->caught_up_ns) / 1000000ull),
+                       (0 == repl->contact_ns) ? -1ll : (long long)((clock_ns(CLOCK_MONOTONIC) - repl->contact_ns) / 1000000ull));
+    }
+    else
+    {
+        size_t npeers = 0;
+        LIST_FOREACH(peer, &repl->peers, entries)
+        {
+            npeers += peer->done ? 0 : 1;
+        }
+        len = snprintf(buf, size, "role:leader\ncommitted:%zu\nfollowers:%zu\n", committed, npeers);
+        LIST_FOREACH(peer, &repl->peers, entries)
+        {
+            if (peer->done || (len < 0) || ((size_t)len >= size))
+            {
+                continue;
+            }
+            lag_bytes = (committed > peer->acked) ? committed - peer->acked : 0;
+            len += snprintf(buf + len, size - (size_t)len, "follower:%s sent:%zu acked:%zu lag_bytes:%zu\n",
+                            peer->addr, peer->sent, peer->acked, lag_bytes);
+        }
+    }
+    pthread_mutex_unlock(&repl->lock);
+    return len;
+}
+
+void replication_stop(struct replication *repl)
+{
+    if (NULL == repl)
+    {
+        return;
+    }
+    repl->stopping = true;
+    pthread_join(repl->thread, NULL);
+    repl_reap(repl, true);
+    repl_free(repl);
+}
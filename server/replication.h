@@ -0,0 +1,80 @@
+/*
+ * ianmclinden, 2024
+ *
+ * Log shipping from a leader aesdsocket to read-only followers. The leader
+ * listens on a replication port and streams the default stream's committed
+ * bytes to every follower that connects, in frames tagged with their log
+ * offset. Frames are batched (whatever has been committed since the last
+ * one, up to REPL_BATCH_BYTES) and pipelined, the leader never waits for a
+ * follower between frames. Followers append what they receive to their own
+ * store, so a byte has the same offset on the leader and on every follower,
+ * and acknowledge what they have applied.
+ *
+ * Frames carry the length of every leader append they hold, and a follower
+ * commits each one as its own entry. A follower with the same backend
+ * settings as its leader therefore holds the same entries and evicts them at
+ * the same points.
+ *
+ * Where it can't simply continue, a follower drops its copy and carries on
+ * at the leader's offset (store_rebase()): when a ring leader evicted data
+ * before it was replicated, and when the leader was restarted and its log is
+ * no longer the one the follower holds.
+ *
+ * Only the default stream is replicated.
+ */
+
+#ifndef AESDSOCKET_REPLICATION_H
+#define AESDSOCKET_REPLICATION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "store.h"
+
+/**
+ * Most log bytes carried by one frame
+ */
+#define REPL_BATCH_BYTES (64 * 1024)
+
+struct replication;
+
+/**
+ * Serve @param store to followers connecting to TCP @param port
+ * @return the running leader, or NULL on failure
+ */
+struct replication *replication_lead(struct store *store, uint16_t port);
+
+/**
+ * Apply the log of the leader at @param leader ("HOST:PORT" of its
+ * replication port) to @param store, which must be empty. The connection is
+ * retried until replication_stop(), resuming from what was already applied
+ * if the leader still has that log.
+ * @return the running follower, or NULL on failure
+ */
+struct replication *replication_follow(struct store *store, const char *leader);
+
+/**
+ * @return true if @param repl is a follower, whose store must not be written
+ * to by anyone else
+ */
+bool replication_is_follower(const struct replication *repl);
+
+/**
+ * Describe the replication state as "key:value" lines in @param buf, for
+ * @param store when @param repl is NULL (no replication). Followers report
+ * lag_bytes, how far behind the leader's last known end of log they are, and
+ * lag_ms, how long the leader had been holding data this follower has not
+ * yet applied, measured on the leader's clock.
+ * @return the length written, as for snprintf()
+ */
+int replication_status(struct replication *repl, struct store *store, char *buf, size_t size);
+
+/**
+ * Stop replicating, join every replication thread and release @param repl.
+ * Call after store_shutdown() so leader threads aren't left waiting on the
+ * store.
+ */
+void replication_stop(struct replication *repl);
+
+#endif /* AESDSOCKET_REPLICATION_H */
@@ -0,0 +1,273 @@
+/*
+ * ianmclinden, 2024
+ *
+ * File backend, every committed line is appended to a log file on disk and
+ * replies are streamed back out of that file.
+ */
+
+#include "store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define FILE_STORE_BLKSZ 4096
+
+struct file_store
+{
+    struct store base;
+    int fd;
+    char *path;
+    /**
+     * Logical offset of the first byte in the file, only moved by
+     * file_store_rebase()
+     */
+    size_t base_offset;
+};
+
+static int file_store_append(struct store *store, const char *buf, size_t len)
+{
+    struct file_store *file = (struct file_store *)store;
+    int rc = 0;
+
+    if (0 != pthread_mutex_lock(&store->lock))
+    {
+        syslog(LOG_ERR, "failed to acquire logfile lock");
+        return -1;
+    }
+
+    if (0 != store_write_all(file->fd, buf, len))
+    {
+        struct stat st;
+        syslog(LOG_ERR, "failed to write %zu bytes to logfile", len);
+        // Don't know how much made it, trust the file
+        if (0 == fstat(file->fd, &st))
+        {
+            store_publish(store, file->base_offset + (size_t)st.st_size);
+        }
+        rc = -1;
+    }
+    else
+    {
+        store_publish(store, store->committed + len);
+    }
+
+    pthread_mutex_unlock(&store->lock);
+    return rc;
+}
+
+// Fallback for destinations sendfile() can't write to
+static ssize_t file_store_copy(struct file_store *file, int fd, size_t offset, size_t end)
+{
+    char buf[FILE_STORE_BLKSZ];
+    size_t start = offset;
+
+    while (offset < end)
+    {
+        size_t want = (end - offset) < sizeof(buf) ? (end - offset) : sizeof(buf);
+        ssize_t rd = pread(file->fd, buf, want, (off_t)offset);
+        if (0 >= rd)
+        {
+            return -1; // Err, or truncated underneath us
+        }
+        if (0 != store_write_all(fd, buf, (size_t)rd))
+        {
+            return -1;
+        }
+        offset += (size_t)rd;
+    }
+    return (ssize_t)(offset - start);
+}
+
+static ssize_t file_store_send(struct store *store, int fd, size_t *offset)
+{
+    struct file_store *file = (struct file_store *)store;
+    size_t base;
+    size_t end;
+    off_t pos;
+    ssize_t sent;
+
+    if (0 != pthread_mutex_lock(&store->lock))
+    {
+        syslog(LOG_ERR, "failed to acquire logfile lock");
+        return -1;
+    }
+    base = file->base_offset;
+    end = store->committed - base;
+    pthread_mutex_unlock(&store->lock);
+
+    // Committed bytes never change, so writers (and other readers) can carry
+    // on while we send, however slowly our peer drains
+    if (*offset < base)
+    {
+        *offset = base;
+    }
+    if (*offset > base + end)
+    {
+        *offset = base + end;
+    }
+    pos = (off_t)(*offset - base);
+    while ((size_t)pos < end)
+    {
+        sent = sendfile(fd, file->fd, &pos, end - (size_t)pos);
+        if (-1 == sent && EINTR == errno)
+        {
+            continue;
+        }
+        if (-1 == sent && (EINVAL == errno || ENOSYS == errno))
+        {
+            sent = file_store_copy(file, fd, (size_t)pos, end);
+            if (-1 == sent)
+            {
+                break;
+            }
+            pos += sent;
+            break;
+        }
+        if (0 >= sent)
+        {
+            break;
+        }
+    }
+
+    sent = (ssize_t)(base + (size_t)pos - *offset);
+    *offset = base + (size_t)pos;
+    return ((size_t)pos == end) ? sent : -1;
+}
+
+static ssize_t file_store_read(struct store *store, size_t *offset, char *buf, size_t len)
+{
+    struct file_store *file = (struct file_store *)store;
+    size_t base;
+    size_t end;
+    size_t got = 0;
+    ssize_t rd;
+
+    if (0 != pthread_mutex_lock(&store->lock))
+    {
+        syslog(LOG_ERR, "failed to acquire logfile lock");
+        return -1;
+    }
+    base = file->base_offset;
+    end = store->committed;
+    pthread_mutex_unlock(&store->lock);
+
+    if (*offset < base)
+    {
+        *offset = base;
+    }
+    if (*offset > end)
+    {
+        *offset = end;
+    }
+    if (len > end - *offset)
+    {
+        len = end - *offset;
+    }
+    while (got < len)
+    {
+        rd = pread(file->fd, buf + got, len - got, (off_t)(*offset - base + got));
+        if (-1 == rd && EINTR == errno)
+        {
+            continue;
+        }
+        if (0 >= rd)
+        {
+            return -1; // Err, or truncated underneath us
+        }
+        got += (size_t)rd;
+    }
+    *offset += got;
+    return (ssize_t)got;
+}
+
+static int file_store_rebase(struct store *store, size_t offset)
+{
+    struct file_store *file = (struct file_store *)store;
+    int rc = 0;
+
+    if (0 != pthread_mutex_lock(&store->lock))
+    {
+        syslog(LOG_ERR, "failed to acquire logfile lock");
+        return -1;
+    }
+    // Appends are O_APPEND, so they follow the file back to the start
+    if (-1 == ftruncate(file->fd, 0))
+    {
+        syslog(LOG_ERR, "failed to truncate logfile: %s", strerror(errno));
+        rc = -1;
+    }
+    else
+    {
+        file->base_offset = offset;
+        store_publish(store, offset);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return rc;
+}
+
+static void file_store_close(struct store *store)
+{
+    struct file_store *file = (struct file_store *)store;
+
+    // Ignore errors
+    close(file->fd);
+    remove(file->path);
+    store_deinit(store);
+    free(file->path);
+    free(file);
+}
+
+static const struct store_ops file_store_ops = {
+    .append = file_store_append,
+    .send = file_store_send,
+    .read = file_store_read,
+    .rebase = file_store_rebase,
+    .close = file_store_close,
+};
+
+struct store *file_store_open(const struct store_config *config)
+{
+    struct file_store *file = malloc(sizeof(struct file_store));
+    if (NULL == file)
+    {
+        syslog(LOG_ERR, "failed to allocate file store");
+        return NULL;
+    }
+    memset(file, 0, sizeof(struct file_store));
+
+    file->path = strdup(config->path);
+    if (NULL == file->path)
+    {
+        syslog(LOG_ERR, "failed to allocate file store");
+        free(file);
+        return NULL;
+    }
+
+    if (0 != store_init(&file->base, &file_store_ops))
+    {
+        syslog(LOG_ERR, "failed to create logfile mutex");
+        free(file->path);
+        free(file);
+        return NULL;
+    }
+
+    // Assume the path exists
+    file->fd = open(file->path, (O_RDWR | O_CREAT | O_TRUNC | O_APPEND), (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+    if (-1 == file->fd)
+    {
+        syslog(LOG_ERR, "failed to open logfile '%s'", file->path);
+        store_deinit(&file->base);
+        free(file->path);
+        free(file);
+        return NULL;
+    }
+
+    return &file->base;
+}
@@ -0,0 +1,354 @@
+/*
+ * ianmclinden, 2024
+ *
+ * gzip encoded replies. The log is cut into STORE_GZIP_BLOCK byte blocks on
+ * logical offsets, and each block goes out as its own gzip member, which
+ * gunzip (or zlib's inflate, member after member) reads back as one stream.
+ * Committed bytes never change, so a full block is compressed once and
+ * cached for every later reply. Only the partial blocks at either end of a
+ * reply are compressed per request.
+ */
+
+#include "store.h"
+
+#ifdef AESDSOCKET_HAVE_ZLIB
+
+#define ZLIB_CONST // const next_in
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <zlib.h>
+
+/**
+ * Cap on cached compressed bytes per store, past it full blocks are
+ * compressed per request like the tail
+ */
+#define STORE_GZIP_CACHE_BYTES (16 * 1024 * 1024)
+
+/**
+ * One compressed block, shared by the cache and every reply sending it
+ */
+struct gzip_block
+{
+    size_t refs;
+    size_t len;
+    char data[];
+};
+
+struct store_gzip_cache
+{
+    pthread_mutex_t lock;
+    /**
+     * Block number of blocks[0], anything before it was evicted from the
+     * store and will never be asked for again
+     */
+    size_t first;
+    size_t count;
+    /**
+     * Holding one reference each, NULL where nothing is cached
+     */
+    struct gzip_block **blocks;
+    size_t bytes;
+    /**
+     * Bumped by store_gzip_reset(), a reply only uses and fills the cache
+     * of the epoch it started in
+     */
+    size_t epoch;
+};
+
+static void gzip_block_get(struct gzip_block *block)
+{
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void gzip_block_put(struct gzip_block *block)
+{
+    if ((NULL != block) && (0 == __atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL)))
+    {
+        free(block);
+    }
+}
+
+// Compress len bytes of in as one gzip member
+// @return a new block holding one reference, or NULL on failure
+static struct gzip_block *gzip_compress(const char *in, size_t len, int level)
+{
+    struct gzip_block *block;
+    z_stream zs;
+    uLong bound;
+    int rc;
+
+    memset(&zs, 0, sizeof(zs));
+    // 16 + MAX_WBITS asks for a gzip wrapper instead of a zlib one
+    if (Z_OK != deflateInit2(&zs, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY))
+    {
+        return NULL;
+    }
+    bound = deflateBound(&zs, (uLong)len);
+    if (NULL == (block = malloc(sizeof(struct gzip_block) + bound)))
+    {
+        deflateEnd(&zs);
+        return NULL;
+    }
+
+    zs.next_in = (const Bytef *)in;
+    zs.avail_in = (uInt)len;
+    zs.next_out = (Bytef *)block->data;
+    zs.avail_out = (uInt)bound;
+    rc = deflate(&zs, Z_FINISH);
+    block->refs = 1;
+    block->len = zs.total_out;
+    deflateEnd(&zs);
+
+    if (Z_STREAM_END != rc)
+    {
+        free(block);
+        return NULL;
+    }
+    return block;
+}
+
+static struct store_gzip_cache *gzip_cache_get(struct store *store)
+{
+    struct store_gzip_cache *cache;
+
+    if (0 != pthread_mutex_lock(&store->lock))
+    {
+        return NULL;
+    }
+    if (NULL == store->gzip)
+    {
+        cache = malloc(sizeof(struct store_gzip_cache));
+        if (NULL != cache)
+        {
+            memset(cache, 0, sizeof(struct store_gzip_cache));
+            if (0 != pthread_mutex_init(&cache->lock, NULL))
+            {
+                free(cache);
+                cache = NULL;
+            }
+        }
+        store->gzip = cache;
+    }
+    cache = store->gzip;
+    pthread_mutex_unlock(&store->lock);
+    return cache;
+}
+
+// Drop blocks before blk, the store no longer holds them. Caller holds the
+// cache lock.
+static void gzip_cache_trim(struct store_gzip_cache *cache, size_t blk)
+{
+    size_t drop = (blk > cache->first) ? (blk - cache->first) : 0;
+
+    if (drop > cache->count)
+    {
+        drop = cache->count;
+    }
+    for (size_t i = 0; i < drop; i++)
+    {
+        if (NULL != cache->blocks[i])
+        {
+            cache->bytes -= cache->blocks[i]->len;
+            gzip_block_put(cache->blocks[i]);
+        }
+    }
+    memmove(cache->blocks, cache->blocks + drop, (cache->count - drop) * sizeof(struct gzip_block *));
+    memset(cache->blocks + cache->count - drop, 0, drop * sizeof(struct gzip_block *));
+    if (blk > cache->first)
+    {
+        cache->first = blk;
+    }
+}
+
+// Pin cached block blk, so it can be sent without holding the lock
+// @return the block, which the caller must put, or NULL if not cached
+static struct gzip_block *gzip_cache_find(struct store_gzip_cache *cache, size_t epoch, size_t blk)
+{
+    struct gzip_block *block = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if ((epoch == cache->epoch) && (blk >= cache->first) && (blk - cache->first < cache->count))
+    {
+        block = cache->blocks[blk - cache->first];
+        if (NULL != block)
+        {
+            gzip_block_get(block);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return block;
+}
+
+// Cache block as blk, taking a reference of its own if there's room
+static void gzip_cache_insert(struct store_gzip_cache *cache, size_t epoch, size_t blk, struct gzip_block *block)
+{
+    pthread_mutex_lock(&cache->lock);
+    if ((epoch == cache->epoch) && (blk >= cache->first) && (cache->bytes + block->len <= STORE_GZIP_CACHE_BYTES))
+    {
+        size_t idx = blk - cache->first;
+        if (idx >= cache->count)
+        {
+            size_t count = (idx + 1 > 2 * cache->count) ? idx + 1 : 2 * cache->count;
+            struct gzip_block **blocks = realloc(cache->blocks, count * sizeof(struct gzip_block *));
+            if (NULL != blocks)
+            {
+                memset(blocks + cache->count, 0, (count - cache->count) * sizeof(struct gzip_block *));
+                cache->blocks = blocks;
+                cache->count = count;
+            }
+        }
+        // Lost a race with another reply, keep theirs
+        if ((idx < cache->count) && (NULL == cache->blocks[idx]))
+        {
+            gzip_block_get(block);
+            cache->blocks[idx] = block;
+            cache->bytes += block->len;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+ssize_t store_gzip_send(struct store *store, int fd, size_t *offset)
+{
+    struct store_gzip_cache *cache = gzip_cache_get(store);
+    struct gzip_block *block;
+    size_t end = store_committed(store);
+    size_t pos = *offset;
+    size_t start;
+    size_t epoch;
+    char *plain;
+    ssize_t rd;
+    int rc = 0;
+
+    if ((NULL == cache) || (NULL == (plain = malloc(STORE_GZIP_BLOCK))))
+    {
+        syslog(LOG_ERR, "failed to allocate gzip reply state");
+        return -1;
+    }
+
+    // Find where the reply really starts, the store may have evicted the
+    // requested offset, and let go of cached blocks from before it
+    if (0 > (rd = store_read(store, &pos, plain, 1)))
+    {
+        free(plain);
+        return -1;
+    }
+    pos -= (size_t)rd;
+    start = pos;
+    pthread_mutex_lock(&cache->lock);
+    gzip_cache_trim(cache, pos / STORE_GZIP_BLOCK);
+    epoch = cache->epoch;
+    pthread_mutex_unlock(&cache->lock);
+
+    // An empty member still makes the reply a valid gzip stream
+    if (pos >= end)
+    {
+        block = gzip_compress(plain, 0, Z_BEST_SPEED);
+        if ((NULL == block) || (0 != store_write_all(fd, block->data, block->len)))
+        {
+            rc = -1;
+        }
+        gzip_block_put(block);
+    }
+
+    while ((0 == rc) && (pos < end))
+    {
+        size_t blk = pos / STORE_GZIP_BLOCK;
+        size_t blk_end = (blk + 1) * STORE_GZIP_BLOCK;
+        bool whole = (pos == blk * STORE_GZIP_BLOCK) && (blk_end <= end);
+        size_t want = ((blk_end < end) ? blk_end : end) - pos;
+
+        block = whole ? gzip_cache_find(cache, epoch, blk) : NULL;
+        if (NULL != block)
+        {
+            pos = blk_end;
+        }
+        else
+        {
+            size_t from = pos;
+            if (0 >= (rd = store_read(store, &pos, plain, want)))
+            {
+                rc = -1;
+                break;
+            }
+            if (pos - (size_t)rd != from)
+            {
+                whole = false; // Evicted underneath us, this is just a tail now
+            }
+            // Cached blocks are compressed once, so they're worth the best
+            // ratio, anything else is paid for by every request
+            if (NULL == (block = gzip_compress(plain, (size_t)rd, whole ? Z_BEST_COMPRESSION : Z_BEST_SPEED)))
+            {
+                syslog(LOG_ERR, "failed to compress %zd log bytes", rd);
+                rc = -1;
+                break;
+            }
+            if (whole)
+            {
+                gzip_cache_insert(cache, epoch, blk, block);
+            }
+        }
+        // Straight from the (possibly shared) block, no copy
+        rc = store_write_all(fd, block->data, block->len);
+        gzip_block_put(block);
+    }
+
+    free(plain);
+    *offset = pos;
+    return (0 == rc) ? (ssize_t)(pos - start) : -1;
+}
+
+void store_gzip_reset(struct store *store)
+{
+    struct store_gzip_cache *cache;
+
+    pthread_mutex_lock(&store->lock);
+    cache = store->gzip;
+    pthread_mutex_unlock(&store->lock);
+    if (NULL != cache)
+    {
+        pthread_mutex_lock(&cache->lock);
+        gzip_cache_trim(cache, cache->first + cache->count);
+        cache->first = 0;
+        cache->epoch++;
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+void store_gzip_release(struct store *store)
+{
+    struct store_gzip_cache *cache = store->gzip;
+
+    if (NULL != cache)
+    {
+        gzip_cache_trim(cache, cache->first + cache->count);
+        free(cache->blocks);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+        store->gzip = NULL;
+    }
+}
+
+#else
+
+ssize_t store_gzip_send(struct store *store, int fd, size_t *offset)
+{
+    (void)store;
+    (void)fd;
+    (void)offset;
+    return -1;
+}
+
+void store_gzip_reset(struct store *store)
+{
+    (void)store;
+}
+
+void store_gzip_release(struct store *store)
+{
+    (void)store;
+}
+
+#endif /* AESDSOCKET_HAVE_ZLIB */
@@ -0,0 +1,359 @@
+/*
+ * ianmclinden, 2024
+ *
+ * In-memory backend, committed lines are kept in an aesd_circular_buffer and
+ * replies are sent straight from those entries with a single writev().
+ * Nothing touches the disk, and the oldest lines are dropped once either the
+ * entry count or the byte budget is exceeded.
+ *
+ * Each line is a refcounted record. Senders pin the records they are about to
+ * send and drop the lock, so a slow reader never stalls writers; an evicted
+ * record is freed by whoever drops the last reference.
+ */
+
+#include "store.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <syslog.h>
+
+#define RING_CAPACITY STORE_RING_MAX_ENTRIES
+
+struct ring_record
+{
+    size_t refs;
+    char data[];
+};
+
+struct ring_store
+{
+    struct store base;
+    struct aesd_circular_buffer buffer;
+    /**
+     * The record behind each slot in buffer, holding one reference each
+     */
+    struct ring_record *records[RING_CAPACITY];
+    size_t entries;
+    size_t bytes;
+    size_t max_entries;
+    size_t max_bytes;
+    /**
+     * Logical offset of the oldest retained byte, advanced by evictions
+     */
+    size_t base_offset;
+};
+
+static void ring_record_get(struct ring_record *record)
+{
+    __atomic_add_fetch(&record->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void ring_record_put(struct ring_record *record)
+{
+    if ((NULL != record) && (0 == __atomic_sub_fetch(&record->refs, 1, __ATOMIC_ACQ_REL)))
+    {
+        free(record);
+    }
+}
+
+// Evict the oldest line. Caller holds the lock and ensures there is one.
+static void ring_store_drop_oldest(struct ring_store *ring)
+{
+    uint8_t slot = ring->buffer.out_offs;
+
+    ring->base_offset += ring->buffer.entry[slot].size;
+    ring->bytes -= ring->buffer.entry[slot].size;
+    ring->entries--;
+    ring_record_put(ring->records[slot]);
+    ring->records[slot] = NULL;
+    ring->buffer.entry[slot].buffptr = NULL;
+    ring->buffer.entry[slot].size = 0;
+    ring->buffer.out_offs = (uint8_t)((slot + 1) % RING_CAPACITY);
+    ring->buffer.full = false;
+}
+
+static int ring_store_append(struct store *store, const char *buf, size_t len)
+{
+    struct ring_store *ring = (struct ring_store *)store;
+    struct aesd_buffer_entry entry;
+    struct ring_record *record;
+
+    if (0 == len)
+    {
+        return 0; // Zero-length entries would be invisible to lookups anyway
+    }
+
+    record = malloc(sizeof(struct ring_record) + len);
+    if (NULL == record)
+    {
+        syslog(LOG_ERR, "failed to allocate %zu bytes for ring entry", len);
+        return -1;
+    }
+    record->refs = 1;
+    memcpy(record->data, buf, len);
+    entry.buffptr = record->data;
+    entry.size = len;
+
+    if (0 != pthread_mutex_lock(&store->lock))
+    {
+        syslog(LOG_ERR, "failed to acquire ring lock");
+        free(record);
+        return -1;
+    }
+
+    // A single line over budget is still kept, it just evicts everything else
+    while ((ring->entries > 0) &&
+           ((ring->entries >= ring->max_entries) || (ring->bytes + len > ring->max_bytes)))
+    {
+        ring_store_drop_oldest(ring);
+    }
+
+    ring->records[ring->buffer.in_offs] = record;
+    aesd_circular_buffer_add_entry(&ring->buffer, &entry);
+    ring->entries++;
+    ring->bytes += len;
+    store_publish(store, ring->base_offset + ring->bytes);
+
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+}
+
+static ssize_t ring_store_send(struct store *store, int fd, size_t *offset)
+{
+    struct ring_store *ring = (struct ring_store *)store;
+    struct iovec iov[RING_CAPACITY];
+    struct ring_record *pinned[RING_CAPACITY];
+    struct iovec *iovp = iov;
+    struct aesd_buffer_entry *first;
+    size_t entry_offs = 0;
+    size_t total = 0;
+    int iovcnt = 0;
+    int npinned = 0;
+    ssize_t rc = 0;
+
+    if (0 != pthread_mutex_lock(&store->lock))
+    {
+        syslog(LOG_ERR, "failed to acquire ring lock");
+        return -1;
+    }
+
+    if (*offset < ring->base_offset)
+    {
+        *offset = ring->base_offset;
+    }
+    if (*offset > store->committed)
+    {
+        *offset = store->committed;
+    }
+
+    first = aesd_circular_buffer_find_entry_offset_for_fpos(&ring->buffer, *offset - ring->base_offset, &entry_offs);
+    if (NULL != first)
+    {
+        // Gather from the matching entry through the newest one
+        size_t slot = (size_t)(first - ring->buffer.entry);
+        size_t skip = (slot + RING_CAPACITY - ring->buffer.out_offs) % RING_CAPACITY;
+        for (size_t i = skip; i < ring->entries; i++)
+        {
+            size_t idx = (ring->buffer.out_offs + i) % RING_CAPACITY;
+            size_t from = (i == skip) ? entry_offs : 0;
+            pinned[npinned] = ring->records[idx];
+            ring_record_get(pinned[npinned++]);
+            iov[iovcnt].iov_base = ring->records[idx]->data + from;
+            iov[iovcnt].iov_len = ring->buffer.entry[idx].size - from;
+            total += iov[iovcnt].iov_len;
+            iovcnt++;
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    while (iovcnt > 0)
+    {
+        ssize_t wrote = writev(fd, iovp, iovcnt);
+        if (-1 == wrote)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            rc = -1;
+            break;
+        }
+        *offset += (size_t)wrote;
+        rc += wrote;
+        // Skip fully written vectors and trim a partially written one
+        while (iovcnt > 0 && (size_t)wrote >= iovp->iov_len)
+        {
+            wrote -= (ssize_t)iovp->iov_len;
+            iovp++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iovp->iov_base = (char *)iovp->iov_base + wrote;
+            iovp->iov_len -= (size_t)wrote;
+        }
+    }
+
+    for (int i = 0; i < npinned; i++)
+    {
+        ring_record_put(pinned[i]);
+    }
+    return (-1 == rc || (size_t)rc != total) ? -1 : rc;
+}
+
+// Copy up to len bytes from offset, noting each entry's share in lens when
+// it isn't NULL
+static ssize_t ring_store_copy(struct store *store, size_t *offset, char *buf, size_t len,
+                               size_t *lens, size_t *nlens, bool *partial)
+{
+    struct ring_store *ring = (struct ring_store *)store;
+    struct aesd_buffer_entry *first;
+    size_t max = (NULL == lens) ? 0 : *nlens;
+    size_t entry_offs = 0;
+    size_t got = 0;
+    size_t n = 0;
+
+    if (0 != pthread_mutex_lock(&store->lock))
+    {
+        syslog(LOG_ERR, "failed to acquire ring lock");
+        return -1;
+    }
+
+    if (*offset < ring->base_offset)
+    {
+        *offset = ring->base_offset;
+    }
+    if (*offset > store->committed)
+    {
+        *offset = store->committed;
+    }
+    if (NULL != lens)
+    {
+        *partial = false;
+    }
+
+    // Bounded by len, so copying under the lock is cheap enough
+    first = aesd_circular_buffer_find_entry_offset_for_fpos(&ring->buffer, *offset - ring->base_offset, &entry_offs);
+    if (NULL != first)
+    {
+        size_t slot = (size_t)(first - ring->buffer.entry);
+        size_t skip = (slot + RING_CAPACITY - ring->buffer.out_offs) % RING_CAPACITY;
+        for (size_t i = skip; (i < ring->entries) && (got < len) && ((NULL == lens) || (n < max)); i++)
+        {
+            size_t idx = (ring->buffer.out_offs + i) % RING_CAPACITY;
+            size_t from = (i == skip) ? entry_offs : 0;
+            size_t want = ring->buffer.entry[idx].size - from;
+            if (want > len - got)
+            {
+                want = len - got;
+                if (NULL != lens)
+                {
+                    *partial = true;
+                }
+            }
+            memcpy(buf + got, ring->records[idx]->data + from, want);
+            got += want;
+            if (NULL != lens)
+            {
+                lens[n++] = want;
+            }
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    if (NULL != lens)
+    {
+        *nlens = n;
+    }
+    *offset += got;
+    return (ssize_t)got;
+}
+
+static ssize_t ring_store_read(struct store *store, size_t *offset, char *buf, size_t len)
+{
+    return ring_store_copy(store, offset, buf, len, NULL, NULL, NULL);
+}
+
+static ssize_t ring_store_read_records(struct store *store, size_t *offset, char *buf, size_t len,
+                                       size_t *lens, size_t *nlens, bool *partial)
+{
+    return ring_store_copy(store, offset, buf, len, lens, nlens, partial);
+}
+
+static int ring_store_rebase(struct store *store, size_t offset)
+{
+    struct ring_store *ring = (struct ring_store *)store;
+
+    if (0 != pthread_mutex_lock(&store->lock))
+    {
+        syslog(LOG_ERR, "failed to acquire ring lock");
+        return -1;
+    }
+    while (ring->entries > 0)
+    {
+        ring_store_drop_oldest(ring);
+    }
+    ring->base_offset = offset;
+    store_publish(store, offset);
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+}
+
+static void ring_store_close(struct store *store)
+{
+    struct ring_store *ring = (struct ring_store *)store;
+
+    for (size_t i = 0; i < RING_CAPACITY; i++)
+    {
+        ring_record_put(ring->records[i]);
+    }
+    store_deinit(store);
+    free(ring);
+}
+
+static const struct store_ops ring_store_ops = {
+    .append = ring_store_append,
+    .send = ring_store_send,
+    .read = ring_store_read,
+    .read_records = ring_store_read_records,
+    .rebase = ring_store_rebase,
+    .close = ring_store_close,
+};
+
+struct store *ring_store_open(const struct store_config *config)
+{
+    struct ring_store *ring;
+
+    if ((0 == config->ring_entries) || (config->ring_entries > RING_CAPACITY))
+    {
+        syslog(LOG_ERR, "ring entries must be between 1 and %d", RING_CAPACITY);
+        return NULL;
+    }
+    if (0 == config->ring_bytes)
+    {
+        syslog(LOG_ERR, "ring byte budget must be non-zero");
+        return NULL;
+    }
+
+    ring = malloc(sizeof(struct ring_store));
+    if (NULL == ring)
+    {
+        syslog(LOG_ERR, "failed to allocate ring store");
+        return NULL;
+    }
+    memset(ring, 0, sizeof(struct ring_store));
+    ring->max_entries = config->ring_entries;
+    ring->max_bytes = config->ring_bytes;
+    aesd_circular_buffer_init(&ring->buffer);
+
+    if (0 != store_init(&ring->base, &ring_store_ops))
+    {
+        syslog(LOG_ERR, "failed to create ring mutex");
+        free(ring);
+        return NULL;
+    }
+
+    return &ring->base;
+}
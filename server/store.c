@@ -0,0 +1,277 @@
+/*
+ * ianmclinden, 2024
+ */
+
+#define _GNU_SOURCE // memfd_create, F_ADD_SEALS
+
+#include "store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+int store_parse_kind(const char *name, enum store_kind *kind)
+{
+    if (0 == strcmp(name, "file"))
+    {
+        *kind = STORE_FILE;
+        return 0;
+    }
+    if (0 == strcmp(name, "ring"))
+    {
+        *kind = STORE_RING;
+        return 0;
+    }
+    return -1;
+}
+
+struct store *store_open(const struct store_config *config)
+{
+    switch (config->kind)
+    {
+    case STORE_FILE:
+        return file_store_open(config);
+    case STORE_RING:
+        return ring_store_open(config);
+    default:
+        return NULL;
+    }
+}
+
+int store_append(struct store *store, const char *buf, size_t len)
+{
+    return store->ops->append(store, buf, len);
+}
+
+ssize_t store_send(struct store *store, int fd, size_t *offset)
+{
+    return store->ops->send(store, fd, offset);
+}
+
+int store_parse_encoding(const char *name, size_t len, enum store_encoding *encoding)
+{
+    if ((strlen("identity") == len) && (0 == strncmp(name, "identity", len)))
+    {
+        *encoding = STORE_ENCODING_IDENTITY;
+        return 0;
+    }
+#ifdef AESDSOCKET_HAVE_ZLIB
+    if ((strlen("gzip") == len) && (0 == strncmp(name, "gzip", len)))
+    {
+        *encoding = STORE_ENCODING_GZIP;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+ssize_t store_send_encoded(struct store *store, int fd, size_t *offset, enum store_encoding encoding)
+{
+    switch (encoding)
+    {
+    case STORE_ENCODING_IDENTITY:
+        return store_send(store, fd, offset);
+    case STORE_ENCODING_GZIP:
+        return store_gzip_send(store, fd, offset);
+    default:
+        return -1;
+    }
+}
+
+ssize_t store_read(struct store *store, size_t *offset, char *buf, size_t len)
+{
+    return store->ops->read(store, offset, buf, len);
+}
+
+ssize_t store_read_records(struct store *store, size_t *offset, char *buf, size_t len,
+                           size_t *lens, size_t *nlens, bool *partial)
+{
+    size_t max = *nlens;
+    size_t from = 0;
+    size_t n = 0;
+    ssize_t rd;
+
+    if (NULL != store->ops->read_records)
+    {
+        return store->ops->read_records(store, offset, buf, len, lens, nlens, partial);
+    }
+
+    *nlens = 0;
+    *partial = false;
+    if (0 >= (rd = store_read(store, offset, buf, len)))
+    {
+        return rd;
+    }
+    for (size_t i = 0; (i < (size_t)rd) && (n < max); i++)
+    {
+        if ('\n' == buf[i])
+        {
+            lens[n++] = i + 1 - from;
+            from = i + 1;
+        }
+    }
+    if ((from < (size_t)rd) && (n < max))
+    {
+        lens[n++] = (size_t)rd - from;
+        from = (size_t)rd;
+        *partial = true;
+    }
+    // Hand back whatever didn't fit in lens
+    *offset -= (size_t)rd - from;
+    *nlens = n;
+    return (ssize_t)from;
+}
+
+int store_rebase(struct store *store, size_t offset)
+{
+    if (0 != store->ops->rebase(store, offset))
+    {
+        return -1;
+    }
+    // Cached blocks may now name different bytes
+    store_gzip_reset(store);
+    return 0;
+}
+
+size_t store_committed(struct store *store)
+{
+    size_t committed;
+
+    pthread_mutex_lock(&store->lock);
+    committed = store->committed;
+    pthread_mutex_unlock(&store->lock);
+    return committed;
+}
+
+int store_snapshot(struct store *store, size_t offset, size_t *size_rtn)
+{
+    int fd = memfd_create("aesdsocket-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    size_t end = offset;
+
+    if (-1 == fd)
+    {
+        syslog(LOG_ERR, "failed to create snapshot memfd");
+        return -1;
+    }
+    if ((0 > store_send(store, fd, &end)) ||
+        (-1 == fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)))
+    {
+        syslog(LOG_ERR, "failed to fill snapshot memfd");
+        close(fd);
+        return -1;
+    }
+
+    *size_rtn = (size_t)lseek(fd, 0, SEEK_END);
+    lseek(fd, 0, SEEK_SET); // Leave it ready for a plain read() too
+    return fd;
+}
+
+int store_wait(struct store *store, size_t offset, int timeout_ms)
+{
+    struct timespec deadline;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    if (0 != pthread_mutex_lock(&store->lock))
+    {
+        syslog(LOG_ERR, "failed to acquire store lock");
+        return -1;
+    }
+    while (!store->closing && (store->committed <= offset))
+    {
+        if (ETIMEDOUT == pthread_cond_timedwait(&store->published, &store->lock, &deadline))
+        {
+            break;
+        }
+    }
+    rc = (store->committed > offset) ? 1 : (store->closing ? -1 : 0);
+    pthread_mutex_unlock(&store->lock);
+    return rc;
+}
+
+void store_shutdown(struct store *store)
+{
+    if (0 == pthread_mutex_lock(&store->lock))
+    {
+        store->closing = true;
+        pthread_cond_broadcast(&store->published);
+        pthread_mutex_unlock(&store->lock);
+    }
+}
+
+void store_close(struct store *store)
+{
+    if (NULL != store)
+    {
+        store->ops->close(store);
+    }
+}
+
+int store_init(struct store *store, const struct store_ops *ops)
+{
+    pthread_condattr_t attr;
+
+    store->ops = ops;
+    store->committed = 0;
+    store->closing = false;
+    store->gzip = NULL;
+
+    if (0 != pthread_mutex_init(&store->lock, NULL))
+    {
+        return -1;
+    }
+    // Waits are relative, don't let wall clock steps stretch them
+    if ((0 != pthread_condattr_init(&attr)) ||
+        (0 != pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) ||
+        (0 != pthread_cond_init(&store->published, &attr)))
+    {
+        pthread_mutex_destroy(&store->lock);
+        return -1;
+    }
+    pthread_condattr_destroy(&attr);
+    return 0;
+}
+
+void store_deinit(struct store *store)
+{
+    store_gzip_release(store);
+    pthread_cond_destroy(&store->published);
+    pthread_mutex_destroy(&store->lock);
+}
+
+void store_publish(struct store *store, size_t committed)
+{
+    store->committed = committed;
+    pthread_cond_broadcast(&store->published);
+}
+
+int store_write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t wrote = write(fd, buf, len);
+        if (-1 == wrote)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += wrote;
+        len -= (size_t)wrote;
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * ianmclinden, 2024
+ *
+ * Storage backends for committed aesdsocket lines. The request path only ever
+ * talks to a struct store, which hides whether lines are persisted to a file
+ * or kept in memory.
+ */
+
+#ifndef AESDSOCKET_STORE_H
+#define AESDSOCKET_STORE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "aesd-circular-buffer.h"
+
+/**
+ * Upper bound on ring backend entries, raise it (up to 255) by building with
+ * -DAESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED=N
+ */
+#define STORE_RING_MAX_ENTRIES AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+/**
+ * Log bytes per compressed block of an encoded reply
+ */
+#define STORE_GZIP_BLOCK (64 * 1024)
+
+enum store_kind
+{
+    STORE_FILE,
+    STORE_RING,
+};
+
+struct store_config
+{
+    enum store_kind kind;
+    /**
+     * File backend: path of the log, truncated on open and removed on close
+     */
+    const char *path;
+    /**
+     * Ring backend: most recent lines to retain, at most
+     * STORE_RING_MAX_ENTRIES
+     */
+    size_t ring_entries;
+    /**
+     * Ring backend: total bytes to retain, oldest lines are evicted first
+     */
+    size_t ring_bytes;
+};
+
+/**
+ * How a reply is put on the wire
+ */
+enum store_encoding
+{
+    STORE_ENCODING_IDENTITY,
+    /**
+     * Concatenated gzip members, one per STORE_GZIP_BLOCK of log. Only
+     * available when built with zlib (AESDSOCKET_HAVE_ZLIB).
+     */
+    STORE_ENCODING_GZIP,
+};
+
+struct store;
+struct store_gzip_cache;
+
+struct store_ops
+{
+    int (*append)(struct store *store, const char *buf, size_t len);
+    ssize_t (*send)(struct store *store, int fd, size_t *offset);
+    ssize_t (*read)(struct store *store, size_t *offset, char *buf, size_t len);
+    /**
+     * Optional, backends that keep appends apart report them here. See
+     * store_read_records().
+     */
+    ssize_t (*read_records)(struct store *store, size_t *offset, char *buf, size_t len,
+                            size_t *lens, size_t *nlens, bool *partial);
+    int (*rebase)(struct store *store, size_t offset);
+    void (*close)(struct store *store);
+};
+
+/**
+ * Common head of every backend, backends embed this as their first member.
+ * Offsets are logical byte positions in the log since it was opened, so they
+ * stay valid for a backend that evicts old data.
+ *
+ * The store doubles as the broadcast point for subscribers: writers publish
+ * the new end of the log once, and every subscriber just keeps its own
+ * offset and waits for committed to move past it.
+ */
+struct store
+{
+    const struct store_ops *ops;
+    pthread_mutex_t lock;
+    pthread_cond_t published;
+    /**
+     * Logical end of the log, only changed via store_publish()
+     */
+    size_t committed;
+    bool closing;
+    /**
+     * Compressed blocks for gzip replies, created on first use
+     */
+    struct store_gzip_cache *gzip;
+};
+
+/**
+ * Parse a backend name ("file" or "ring") into @param kind
+ * @return 0 on success, -1 for an unknown name
+ */
+int store_parse_kind(const char *name, enum store_kind *kind);
+
+/**
+ * Open the backend described by @param config
+ * @return the new store, or NULL on failure
+ */
+struct store *store_open(const struct store_config *config);
+
+/**
+ * Commit @param len bytes of @param buf to the end of the log
+ * @return 0 on success, -1 on failure
+ */
+int store_append(struct store *store, const char *buf, size_t len);
+
+/**
+ * Write everything in the log from @param offset up to its current end to
+ * @param fd. On return @param offset holds the position just past the last
+ * byte written. If the data at @param offset has already been evicted, the
+ * send starts from the oldest retained byte instead.
+ * @return bytes written, or -1 on failure
+ */
+ssize_t store_send(struct store *store, int fd, size_t *offset);
+
+/**
+ * Parse an encoding name ("identity" or "gzip") of @param len bytes into
+ * @param encoding
+ * @return 0 on success, -1 for a name that's unknown or not built in
+ */
+int store_parse_encoding(const char *name, size_t len, enum store_encoding *encoding);
+
+/**
+ * store_send(), but with the reply in @param encoding. The return value and
+ * @param offset count log bytes, not bytes on the wire.
+ */
+ssize_t store_send_encoded(struct store *store, int fd, size_t *offset, enum store_encoding encoding);
+
+/**
+ * Copy up to @param len bytes of the log from @param offset into
+ * @param buf. @param offset is adjusted exactly as for store_send(), so the
+ * copied bytes start at the returned @param offset minus the return value.
+ * @return bytes copied, 0 if there is nothing past @param offset, or -1 on
+ * failure
+ */
+ssize_t store_read(struct store *store, size_t *offset, char *buf, size_t len);
+
+/**
+ * store_read(), but also split the copied bytes at the appends they were
+ * committed by. @param lens receives the length of each piece, up to
+ * @param nlens of them, and @param nlens is set to how many there are. The
+ * first piece is the tail of an append when @param offset falls inside one.
+ * @param partial is set when the last piece stops short of its append's end,
+ * because @param len ran out. Backends that don't keep appends apart (file)
+ * split after each '\n' instead, and a trailing unterminated line counts as
+ * partial.
+ * @return bytes copied, as for store_read()
+ */
+ssize_t store_read_records(struct store *store, size_t *offset, char *buf, size_t len,
+                           size_t *lens, size_t *nlens, bool *partial);
+
+/**
+ * Drop the whole log and carry on as if it had always ended at
+ * @param offset, which may be before or past the current end. Only for a
+ * follower taking on its leader's offsets, the next append lands at
+ * @param offset.
+ * @return 0 on success, -1 on failure
+ */
+int store_rebase(struct store *store, size_t offset);
+
+/**
+ * @return the current end of the log
+ */
+size_t store_committed(struct store *store);
+
+/**
+ * Copy the log from @param offset to its current end into a sealed memfd,
+ * which can be handed to a local reader to mmap. The seals make it
+ * effectively read-only for whoever receives it.
+ * @param size_rtn set to the size of the snapshot
+ * @return the memfd, or -1 on failure
+ */
+int store_snapshot(struct store *store, size_t offset, size_t *size_rtn);
+
+/**
+ * Wait up to @param timeout_ms for the log to grow past @param offset
+ * @return 1 if there is data past @param offset, 0 on timeout, -1 if the
+ * store is shutting down
+ */
+int store_wait(struct store *store, size_t offset, int timeout_ms);
+
+/**
+ * Wake every waiter and make further store_wait() calls return -1, call
+ * before tearing down the threads that use the store
+ */
+void store_shutdown(struct store *store);
+
+/**
+ * Release the store and everything it holds
+ */
+void store_close(struct store *store);
+
+// Backend helpers
+
+/**
+ * Initialize the common head of a backend
+ * @return 0 on success, -1 on failure
+ */
+int store_init(struct store *store, const struct store_ops *ops);
+
+/**
+ * Release what store_init() set up
+ */
+void store_deinit(struct store *store);
+
+/**
+ * Move the end of the log to @param committed and wake subscribers. Caller
+ * holds store->lock.
+ */
+void store_publish(struct store *store, size_t committed);
+
+/**
+ * Write all of @param len bytes of @param buf to @param fd, retrying short
+ * writes
+ * @return 0 on success, -1 on failure
+ */
+int store_write_all(int fd, const char *buf, size_t len);
+
+// Encoders, use store_send_encoded instead
+ssize_t store_gzip_send(struct store *store, int fd, size_t *offset);
+void store_gzip_reset(struct store *store);
+void store_gzip_release(struct store *store);
+
+// Backends, use store_open instead
+struct store *file_store_open(const struct store_config *config);
+struct store *ring_store_open(const struct store_config *config);
+
+#endif /* AESDSOCKET_STORE_H */
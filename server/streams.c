@@ -0,0 +1,328 @@
+/*
+ * ianmclinden, 2024
+ */
+
+#include "streams.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/queue.h>
+
+#define STREAM_SHARD_BUCKETS 64
+#define STREAMS_MAX 1024
+
+struct stream
+{
+    char name[STREAM_NAME_MAX + 1];
+    uint64_t hash;
+    /**
+     * NULL until the creating thread has opened it, see streams_get()
+     */
+    struct store *store;
+    LIST_ENTRY(stream)
+    entries;
+};
+
+LIST_HEAD(stream_list, stream);
+
+struct stream_shard
+{
+    /**
+     * Guards the buckets only, each stream's store has its own lock
+     */
+    pthread_rwlock_t lock;
+    struct stream_list buckets[STREAM_SHARD_BUCKETS];
+};
+
+struct streams
+{
+    struct store_config config;
+    struct store *unnamed;
+    size_t count;
+    size_t nshards;
+    struct stream_shard *shards;
+    /**
+     * Lookups that find a stream still being opened wait here
+     */
+    pthread_mutex_t opening_lock;
+    pthread_cond_t opened;
+};
+
+// FNV-1a, the low bits pick the shard and the high bits the bucket
+static uint64_t stream_hash(const char *name, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+bool stream_name_valid(const char *name, size_t len)
+{
+    if ((0 == len) || (len > STREAM_NAME_MAX))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!isalnum((unsigned char)name[i]) && ('_' != name[i]) && ('-' != name[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct streams *streams_open(const struct store_config *config, size_t nshards)
+{
+    struct streams *streams;
+
+    nshards = (0 == nshards) ? 1 : nshards;
+    streams = malloc(sizeof(struct streams));
+    if (NULL == streams)
+    {
+        syslog(LOG_ERR, "failed to allocate stream table");
+        return NULL;
+    }
+    memset(streams, 0, sizeof(struct streams));
+    streams->config = *config;
+    streams->nshards = nshards;
+
+    streams->shards = calloc(nshards, sizeof(struct stream_shard));
+    if (NULL == streams->shards)
+    {
+        syslog(LOG_ERR, "failed to allocate stream shards");
+        free(streams);
+        return NULL;
+    }
+    for (size_t i = 0; i < nshards; i++)
+    {
+        // Default attributes can't fail on Linux, and buckets are already zeroed
+        pthread_rwlock_init(&streams->shards[i].lock, NULL);
+    }
+    pthread_mutex_init(&streams->opening_lock, NULL);
+    pthread_cond_init(&streams->opened, NULL);
+
+    streams->unnamed = store_open(config);
+    if (NULL == streams->unnamed)
+    {
+        streams_close(streams);
+        return NULL;
+    }
+    return streams;
+}
+
+struct store *streams_default(struct streams *streams)
+{
+    return streams->unnamed;
+}
+
+static struct stream *stream_find(struct stream_list *bucket, uint64_t hash, const char *name, size_t len)
+{
+    struct stream *stream;
+    LIST_FOREACH(stream, bucket, entries)
+    {
+        if ((stream->hash == hash) && (0 == strncmp(stream->name, name, len)) && ('\0' == stream->name[len]))
+        {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+// Allocate a stream entry, its store is opened separately by the caller
+static struct stream *stream_create(struct streams *streams, uint64_t hash, const char *name, size_t len)
+{
+    struct stream *stream;
+
+    if (__atomic_add_fetch(&streams->count, 1, __ATOMIC_RELAXED) > STREAMS_MAX)
+    {
+        __atomic_sub_fetch(&streams->count, 1, __ATOMIC_RELAXED);
+        syslog(LOG_ERR, "refusing to create more than %d streams", STREAMS_MAX);
+        return NULL;
+    }
+
+    stream = malloc(sizeof(struct stream));
+    if (NULL == stream)
+    {
+        syslog(LOG_ERR, "failed to allocate stream");
+        __atomic_sub_fetch(&streams->count, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    memcpy(stream->name, name, len);
+    stream->name[len] = '\0';
+    stream->hash = hash;
+    stream->store = NULL;
+    return stream;
+}
+
+static struct store *stream_open_store(struct streams *streams, const struct stream *stream)
+{
+    struct store_config config = streams->config;
+    struct store *store;
+    char *path = NULL;
+
+    if (STORE_FILE == config.kind)
+    {
+        size_t path_len = strlen(config.path) + 1 + strlen(stream->name) + 1;
+        path = malloc(path_len);
+        if (NULL == path)
+        {
+            syslog(LOG_ERR, "failed to allocate stream path");
+            return NULL;
+        }
+        snprintf(path, path_len, "%s.%s", config.path, stream->name);
+        config.path = path;
+    }
+
+    store = store_open(&config);
+    free(path); // Copied by the store
+    if (NULL != store)
+    {
+        syslog(LOG_DEBUG, "Created stream '%s'", stream->name);
+    }
+    return store;
+}
+
+struct store *streams_get(struct streams *streams, const char *name, size_t len)
+{
+    uint64_t hash = stream_hash(name, len);
+    struct stream_shard *shard = &streams->shards[hash % streams->nshards];
+    struct stream_list *bucket = &shard->buckets[(hash >> 32) % STREAM_SHARD_BUCKETS];
+    struct stream *stream;
+    struct store *store = NULL;
+    bool creating = false;
+
+    // Streams live until shutdown, so a hit under the read lock is safe to use
+    if (0 != pthread_rwlock_rdlock(&shard->lock))
+    {
+        syslog(LOG_ERR, "failed to acquire stream shard lock");
+        return NULL;
+    }
+    stream = stream_find(bucket, hash, name, len);
+    store = (NULL == stream) ? NULL : stream->store;
+    pthread_rwlock_unlock(&shard->lock);
+    if (NULL != store)
+    {
+        return store;
+    }
+
+    // Claim the name with an entry that has no store yet, so the open (which
+    // for a file truncates it, and may be slow) happens outside the lock and
+    // exactly once
+    if (0 != pthread_rwlock_wrlock(&shard->lock))
+    {
+        syslog(LOG_ERR, "failed to acquire stream shard lock");
+        return NULL;
+    }
+    stream = stream_find(bucket, hash, name, len);
+    if ((NULL == stream) && (NULL != (stream = stream_create(streams, hash, name, len))))
+    {
+        LIST_INSERT_HEAD(bucket, stream, entries);
+        creating = true;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (NULL == stream)
+    {
+        return NULL;
+    }
+
+    if (creating)
+    {
+        store = stream_open_store(streams, stream);
+        pthread_rwlock_wrlock(&shard->lock); // Ignore errors, as for unlock
+        if (NULL == store)
+        {
+            LIST_REMOVE(stream, entries);
+            free(stream);
+            __atomic_sub_fetch(&streams->count, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            stream->store = store;
+        }
+        pthread_rwlock_unlock(&shard->lock);
+
+        pthread_mutex_lock(&streams->opening_lock);
+        pthread_cond_broadcast(&streams->opened);
+        pthread_mutex_unlock(&streams->opening_lock);
+        return store;
+    }
+
+    // Someone else is opening it, wait until it's open or gone
+    pthread_mutex_lock(&streams->opening_lock);
+    while (true)
+    {
+        pthread_rwlock_rdlock(&shard->lock);
+        stream = stream_find(bucket, hash, name, len);
+        store = (NULL == stream) ? NULL : stream->store;
+        pthread_rwlock_unlock(&shard->lock);
+        if ((NULL == stream) || (NULL != store))
+        {
+            break;
+        }
+        pthread_cond_wait(&streams->opened, &streams->opening_lock);
+    }
+    pthread_mutex_unlock(&streams->opening_lock);
+    return store;
+}
+
+void streams_shutdown(struct streams *streams)
+{
+    store_shutdown(streams->unnamed);
+    for (size_t i = 0; i < streams->nshards; i++)
+    {
+        struct stream_shard *shard = &streams->shards[i];
+        pthread_rwlock_rdlock(&shard->lock); // Ignore errors
+        for (size_t b = 0; b < STREAM_SHARD_BUCKETS; b++)
+        {
+            struct stream *stream;
+            LIST_FOREACH(stream, &shard->buckets[b], entries)
+            {
+                if (NULL != stream->store) // Still being opened
+                {
+                    store_shutdown(stream->store);
+                }
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+void streams_close(struct streams *streams)
+{
+    if (NULL == streams)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < streams->nshards; i++)
+    {
+        struct stream_shard *shard = &streams->shards[i];
+        for (size_t b = 0; b < STREAM_SHARD_BUCKETS; b++)
+        {
+            struct stream *stream = LIST_FIRST(&shard->buckets[b]);
+            while (NULL != stream)
+            {
+                struct stream *next = LIST_NEXT(stream, entries);
+                store_close(stream->store);
+                free(stream);
+                stream = next;
+            }
+        }
+        pthread_rwlock_destroy(&shard->lock);
+    }
+    free(streams->shards);
+    pthread_cond_destroy(&streams->opened);
+    pthread_mutex_destroy(&streams->opening_lock);
+    store_close(streams->unnamed);
+    free(streams);
+}
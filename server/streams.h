@@ -0,0 +1,58 @@
+/*
+ * ianmclinden, 2024
+ *
+ * Named streams, each with its own store (log, lock and offset index). The
+ * stream table is split into shards with independent locks so lookups for
+ * unrelated streams don't contend. The unnamed default stream is just the
+ * store described by the configuration, exactly as without streams.
+ */
+
+#ifndef AESDSOCKET_STREAMS_H
+#define AESDSOCKET_STREAMS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "store.h"
+
+#define STREAM_NAME_MAX 64
+
+struct streams;
+
+/**
+ * Open the default stream from @param config and prepare @param nshards
+ * shards for named streams, which are created on first use with the same
+ * configuration. File backed streams log to "<path>.<name>".
+ * @return the stream table, or NULL on failure
+ */
+struct streams *streams_open(const struct store_config *config, size_t nshards);
+
+/**
+ * @return true if the @param len bytes at @param name are a usable stream
+ * name: 1 to STREAM_NAME_MAX characters of [A-Za-z0-9_-]
+ */
+bool stream_name_valid(const char *name, size_t len);
+
+/**
+ * @return the default stream's store
+ */
+struct store *streams_default(struct streams *streams);
+
+/**
+ * Find or create the stream named by the @param len bytes at @param name,
+ * which must be valid per stream_name_valid()
+ * @return the stream's store, or NULL on failure
+ */
+struct store *streams_get(struct streams *streams, const char *name, size_t len);
+
+/**
+ * store_shutdown() every stream
+ */
+void streams_shutdown(struct streams *streams);
+
+/**
+ * Close every stream and release the table
+ */
+void streams_close(struct streams *streams);
+
+#endif /* AESDSOCKET_STREAMS_H */